@@ -1,717 +1,6368 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <ctype.h>
-#include <string.h>
-#include <math.h>
-
-// pixel struct
-typedef struct Pixel{
-	unsigned char red;
-	unsigned char green;
-	unsigned char blue;
-} Pixel;
-
-// object struct
-typedef struct {
-    int kind;
-    union {
-        // camera
-        struct {
-            double width;
-            double height;
-        } camera;
-        // sphere
-        struct {
-            double position[3];
-            double radius;
-            double diffuse[3];
-            double specular[3];
-        } sphere;
-        // plane
-        struct {
-            double position[3];
-            double normal[3];
-            double diffuse[3];
-            double specular[3];
-        } plane;
-        // light
-        struct {
-            double position[3];
-            double color[3];
-            double theta;
-            double direction[3];
-            double radial[3];
-            double angular;
-        } light;
-    };
-} Object;
-
-
-// array of objects, 128 max length
-Object* object_array[128];
-int obj = 0;
-int line = 1;
-
-// next character from json file
-int next_c(FILE* json) {
-    int c = fgetc(json);
-#ifdef DEBUG
-    printf("next_c: '%c'\n", c);
-#endif
-    if (c == '\n') {
-        line += 1;
-    }
-    if (c == EOF) {
-        fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-        exit(1);
-    }
-    return c;
-}
-
-
-void expect_c(FILE* json, int d) {
-    int c = next_c(json);
-    if (c == d) return;
-    fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
-    exit(1);
-}
-
-
-// skip white space
-void skip_ws(FILE* json) {
-    int c = next_c(json);
-    while (isspace(c)) {
-        c = next_c(json);
-    }
-    ungetc(c, json);
-}
-
-
-// get next string
-char* next_string(FILE* json) {
-    char buffer[129];
-    int c = next_c(json);
-    if (c != '"') {
-        fprintf(stderr, "Error: Expected string on line %d.\n", line);
-        exit(1);
-    }
-    c = next_c(json);
-    int i = 0;
-    while (c != '"') {
-        if (i >= 128) {
-            fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
-            exit(1);
-        }
-        if (c == '\\') {
-            fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
-            exit(1);
-        }
-        if (c < 32 || c > 126) {
-            fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
-            exit(1);
-        }
-        buffer[i] = c;
-        i += 1;
-        c = next_c(json);
-    }
-    buffer[i] = 0;
-    return strdup(buffer);
-}
-
-// get next number
-double next_number(FILE* json) {
-    double value;
-    fscanf(json, "%lf", &value);
-    // Error check this..
-    return value;
-}
-
-// get next vector
-double* next_vector(FILE* json) {
-    double* v = malloc(3*sizeof(double));
-    expect_c(json, '[');
-    skip_ws(json);
-    v[0] = next_number(json);
-    skip_ws(json);
-    expect_c(json, ',');
-    skip_ws(json);
-    v[1] = next_number(json);
-    skip_ws(json);
-    expect_c(json, ',');
-    skip_ws(json);
-    v[2] = next_number(json);
-    skip_ws(json);
-    expect_c(json, ']');
-    return v;
-}
-
-// read json file
-void read_scene(char* filename) {
-    int c;
-    FILE* json = fopen(filename, "r");
-    
-    if (json == NULL) {
-        fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-        exit(1);
-    }
-    
-    skip_ws(json);
-    
-    // Find the beginning of the list
-    expect_c(json, '[');
-    
-    skip_ws(json);
-    
-    // Find the objects
-    
-    while (1) {
-        c = fgetc(json);
-        if (c == ']') {
-            fprintf(stderr, "Error: This is the worst scene file EVER.\n");
-            fclose(json);
-            return;
-        }
-        if (c == '{') {
-            skip_ws(json);
-            
-            // Parse the object
-            char* key = next_string(json);
-            if (strcmp(key, "type") != 0) {
-                fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-                exit(1);
-            }
-            
-            skip_ws(json);
-            
-            expect_c(json, ':');
-            
-            skip_ws(json);
-            
-            char* value = next_string(json);
-            object_array[obj] = malloc(sizeof(Object));
-            Object new;
-            if (strcmp(value, "camera") == 0) {
-                (*object_array[obj]).kind = 0;
-            } else if (strcmp(value, "sphere") == 0) {
-                (*object_array[obj]).kind = 1;
-            } else if (strcmp(value, "plane") == 0) {
-                (*object_array[obj]).kind = 2;
-            } else if (strcmp(value, "light") == 0) {
-                (*object_array[obj]).kind = 3;
-            } else {
-                fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
-                exit(1);
-            }
-            
-            skip_ws(json);
-            
-            while (1) {
-                c = next_c(json);
-                if (c == '}') {
-                    // end of current object
-                    obj++;
-                    break;
-                } else if (c == ',') {
-                    // there are more objects to be read
-                    skip_ws(json);
-                    char* key = next_string(json);
-                    skip_ws(json);
-                    expect_c(json, ':');
-                    skip_ws(json);
-                    // check double field values
-                    if ((strcmp(key, "width") == 0) ||
-                        (strcmp(key, "height") == 0) ||
-                        (strcmp(key, "radius") == 0) ||
-                        (strcmp(key, "theta") == 0) ||
-                        (strcmp(key, "radial-a2") == 0) ||
-                        (strcmp(key, "radial-a1") == 0) ||
-                        (strcmp(key, "radial-a0") == 0) ||
-                        (strcmp(key, "angular-a0") == 0)) {
-                        double value = next_number(json);
-                        if(strcmp(key, "width") == 0){
-                            if((*object_array[obj]).kind == 0){
-                              (*object_array[obj]).camera.width = value;
-                            }
-                        }
-                        else if(strcmp(key, "height") == 0){
-                            if((*object_array[obj]).kind == 0){
-                                (*object_array[obj]).camera.height = value;
-                            }
-                        }
-                        else if(strcmp(key, "radius") == 0){
-                            (*object_array[obj]).sphere.radius = value;
-                        }
-                        else if(strcmp(key, "theta") == 0) {
-                            (*object_array[obj]).light.theta = value;
-                        }
-                        else if(strcmp(key, "radial-a2") == 0) {
-                            (*object_array[obj]).light.radial[2] = value;
-                        }
-                        else if(strcmp(key, "radial-a1") == 0) {
-                            (*object_array[obj]).light.radial[1] = value;
-                        }
-                        else if(strcmp(key, "radial-a0") == 0) {
-                            (*object_array[obj]).light.radial[0] = value;
-                        }
-                        else if(strcmp(key, "angular-a0") == 0) {
-                            (*object_array[obj]).light.angular = value;
-                        }
-                        // check object vector values
-                    } else if ((strcmp(key, "color") == 0) ||
-                               (strcmp(key, "position") == 0) ||
-                               (strcmp(key, "normal") == 0) ||
-                               (strcmp(key, "diffuse_color") == 0) ||
-                               (strcmp(key, "specular_color") == 0) ||
-                               (strcmp(key, "direction") == 0)) {
-                        double* value = next_vector(json);
-                        if(strcmp(key, "color") == 0){
-                            (*object_array[obj]).light.color[0] = value[0];
-                            (*object_array[obj]).light.color[1] = value[1];
-                            (*object_array[obj]).light.color[2] = value[2];
-                        }
-                        else if(strcmp(key, "position") == 0){
-                            if((*object_array[obj]).kind == 1){
-                                (*object_array[obj]).sphere.position[0] = value[0];
-                                (*object_array[obj]).sphere.position[1] = value[1];
-                                (*object_array[obj]).sphere.position[2] = value[2];
-                            }
-                            else if((*object_array[obj]).kind == 2){
-                                (*object_array[obj]).plane.position[0] = value[0];
-                                (*object_array[obj]).plane.position[1] = value[1];
-                                (*object_array[obj]).plane.position[2] = value[2];
-                            }
-                            else if((*object_array[obj]).kind == 3){
-                                (*object_array[obj]).light.position[0] = value[0];
-                                (*object_array[obj]).light.position[1] = value[1];
-                                (*object_array[obj]).light.position[2] = value[2];
-                            }
-                        }
-                        else if(strcmp(key, "normal") == 0){
-                            (*object_array[obj]).plane.normal[0] = value[0];
-                            (*object_array[obj]).plane.normal[1] = value[1];
-                            (*object_array[obj]).plane.normal[2] = value[2];
-                        }
-                        else if(strcmp(key, "diffuse_color") == 0){
-                            if((*object_array[obj]).kind == 1){
-                                (*object_array[obj]).sphere.diffuse[0] = value[0];
-                                (*object_array[obj]).sphere.diffuse[1] = value[1];
-                                (*object_array[obj]).sphere.diffuse[2] = value[2];
-                            }
-                            else if((*object_array[obj]).kind == 2){
-                                (*object_array[obj]).plane.diffuse[0] = value[0];
-                                (*object_array[obj]).plane.diffuse[1] = value[1];
-                                (*object_array[obj]).plane.diffuse[2] = value[2];
-                            }
-                        }
-                        else if(strcmp(key, "specular_color") == 0){
-                            if((*object_array[obj]).kind == 1){
-                                (*object_array[obj]).sphere.specular[0] = value[0];
-                                (*object_array[obj]).sphere.specular[1] = value[1];
-                                (*object_array[obj]).sphere.specular[2] = value[2];
-                            }
-                            else if((*object_array[obj]).kind == 2){
-                                (*object_array[obj]).plane.specular[0] = value[0];
-                                (*object_array[obj]).plane.specular[1] = value[1];
-                                (*object_array[obj]).plane.specular[2] = value[2];
-                            }
-                        }
-                        else if(strcmp(key, "direction") == 0) {
-                            (*object_array[obj]).light.direction[0] = value[0];
-                            (*object_array[obj]).light.direction[1] = value[1];
-                            (*object_array[obj]).light.direction[2] = value[2];
-                        }
-                    } else {
-                        fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                                key, line);
-                    }
-                    skip_ws(json);
-                } else {
-                    fprintf(stderr, "Error: Unexpected value on line %d\n", line);
-                    exit(1);
-                }
-            }
-            skip_ws(json);
-            c = next_c(json);
-            if (c == ',') {
-                skip_ws(json);
-            } else if (c == ']') {
-                fclose(json);
-                object_array[obj] = NULL;
-                return;
-            } else {
-                fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
-                exit(1);
-            }
-        }
-    }
-}
-
-// array of light objects
-Object* lights[128];
-int light = 0;
-
-// square root
-static inline double sqr(double v) {
-    return v*v;
-}
-
-// normalize a vector
-static inline void normalize(double* v) {
-    double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
-    v[0] /= len;
-    v[1] /= len;
-    v[2] /= len;
-}
-
-// compute dot product of two vectors
-double dot(double* a, double* b) {
-    double result;
-    result = a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
-    return result;
-}
-
-// calculate magnitude of vector
-double magnitude(double* v){
-    return sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
-}
-
-// scale vector by s
-void scale(double* v, double s){
-    v[0] *= s;
-    v[1] *= s;
-    v[2] *= s;
-}
-
-// subtract two vectors
-void subtract(double* v1, double* v2){
-    v1[0] -= v2[0];
-    v1[1] -= v2[1];
-    v1[2] -= v2[2];
-}
-
-// calculate reflection vector
-void reflect(double* v, double* n, double* r){
-    double dotResult = dot(v, n);
-    dotResult *= 2;
-    double nNew[3] = {
-        n[0],
-        n[1],
-        n[2]
-    };
-    scale(nNew, dotResult);
-    r[0] = v[0];
-    r[1] = v[1];
-    r[2] = v[2];
-    subtract(r, nNew);
-}
-
-// clamp our color values
-double clamp(double number){
-    number *= 255;
-    if (number < 0) {
-        return 0;
-    }
-    else if (number > 255){
-        return 255;
-    }
-    else {
-        return number;
-    }
-}
-
-// go through objects and add lights to light array
-void collect_lights (){
-    int i = 0;
-    for (i = 0; object_array[i] != 0; i++) {
-        if (object_array[i]->kind == 3){
-            lights[light] = object_array[i];
-            light++;
-        }
-    }
-}
-
-// angular light equation
-double fangular(double* Vo, double* Vl, double a1, double angle) {
-    double dotResult = dot(Vo, Vl);
-    if (acos(dotResult) > angle / 2) {
-        return 0;
-    } else {
-        return pow(dotResult, a1);
-    }
-}
-
-// radial light equation
-double fradial(double a2, double a1, double a0, double d) {
-    double quotient = a2 * sqr(d) + a1 * d + a0;
-    if (quotient == 0) {
-        return 0;
-    }
-    if (d == INFINITY) {
-        return 1;
-    } else {
-        return 1.0 / quotient;
-    }
-}
-
-// diffuse light equation
-double diffuse_l(double Kd, double Il, double* N, double* L) {
-    double dotResult = dot(N, L);
-    if (dotResult > 0) {
-        return Kd * Il * dotResult;
-    } else {
-        return 0;
-    }
-}
-
-// specular light equation
-double specular_l(double Ks, double Il, double* V, double* R, double* N, double* L, double ns) {
-    double dotResult = dot(V, R);
-    if (dotResult > 0 && dot(N, L) > 0) {
-        return Ks * Il * pow(dotResult, ns);
-    } else {
-        return 0;
-    }
-}
-
-// intersection of ray and sphere object
-double sphere_intersection(double* Ro, double* Rd,
-                           double* C, double r) {
-    double a = (sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
-    double b = (2*(Ro[0]*Rd[0] - Rd[0]*C[0] + Ro[1]*Rd[1] - Rd[1]*C[1] + Ro[2]*Rd[2] - Rd[2]*C[2]));
-    double c = sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0]) + Ro[1] - 2*Ro[1]*C[1] + sqr(C[1]) + sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2]) - sqr(r);
-    
-    double det = sqr(b) - 4 * a * c;
-    if (det < 0) return -1;
-    
-    det = sqrt(det);
-    
-    double t0 = (-b - det) / (2*a);
-    if (t0 > 0) return t0;
-    
-    double t1 = (-b + det) / (2*a);
-    if (t1 > 0) return t1;
-    
-    return -1;
-    
-}
-
-// intersection of ray and plane object
-double plane_intersection(double* Ro, double* Rd,
-                          double* C, double* N) {
-    double subtract[3];
-    subtract[0] = C[0]-Ro[0];
-    subtract[1] = C[1]-Ro[1];
-    subtract[2] = C[2]-Ro[2];
-    double dot1 = N[0]*subtract[0] + N[1]*subtract[1] + N[2]*subtract[2];
-    double dot2 = N[0]*Rd[0] + N[1]*Rd[1] + N[2]*Rd[2];
-    
-    return dot1/dot2;
-}
-
-int main(int argc, char **argv) {
-    
-    // create file pointer for output image
-    FILE* output;
-    output = fopen(argv[4], "wb+");
-    // we will create a p3 image
-    fprintf(output, "P3\n");
-    fprintf(output, "%d %d\n%d\n", atoi(argv[1]), atoi(argv[2]), 255);
-    read_scene(argv[3]);
-    collect_lights();
-    int i = 0;
-    double w;
-    double h;
-
-    // set camera width and height
-    while(1){
-        if (object_array[i]->kind == 0){
-            w = object_array[i]->camera.width;
-            h = object_array[i]->camera.height;
-            break;
-        }
-        i++;
-    }
-    
-    double cx = 0;
-    double cy = 0;
-    
-    int M = atoi(argv[2]);
-    int N = atoi(argv[1]);
-    
-    Pixel* image = malloc(sizeof(Pixel)*M*N);
-    int pixelNum = 0;
-    
-    double pixheight = h / M;
-    double pixwidth = w / N;
-    double color[3] = {0,0,0};
-    int best;
-
-    for (int y = M; y > 0; y--) {
-        for (int x = 0; x < N; x += 1) {
-            double Ro[3] = {0, 0, 0};
-            double Rd[3] = {
-                cx - (w/2) + pixwidth * (x + 0.5),
-                cy - (h/2) + pixheight * (y + 0.5),
-                1
-            };
-            normalize(Rd);
-            double best_t = INFINITY;
-            for (int i=0; object_array[i] != 0; i++) {
-                int type;
-                double t = 0;
-                switch(object_array[i]->kind) {
-                    case 0:
-                        // pass, it's a camera
-                        break;
-                    case 1:
-                        // sphere intersection check
-                        type = 1;
-                        t = sphere_intersection(Ro, Rd,
-                                                object_array[i]->sphere.position,
-                                                object_array[i]->sphere.radius);
-                        break;
-                    case 2:
-                        // plane intersection check
-                        type = 2;
-                        t = plane_intersection(Ro, Rd,
-                                               object_array[i]->plane.position,
-                                               object_array[i]->plane.normal);
-                        break;
-                    case 3:
-                        // pass, it's a light
-                        break;
-                    default:
-                        // object not found... whoops...
-                        exit(1);
-                }
-                if (t > 0 && t < best_t) {
-                    best_t = t;
-                    best = i;
-                }
-            }
-            int closest_shadow_object;
-            if (best_t > 0 && best_t != INFINITY) {
-                for (int i = 0; lights[i] != NULL; i++) {
-                    double ron[3] = {best_t*Rd[0]+Ro[0],
-                        best_t*Rd[1]+Ro[1],
-                        best_t*Rd[2]+Ro[2]};
-                    double rdn[3] = {lights[i]->light.position[0] - ron[0],
-                        lights[i]->light.position[1] - ron[1],
-                        lights[i]->light.position[2] - ron[2]};
-                    normalize(rdn);
-                    closest_shadow_object = 0;
-                    for (int j = 0; object_array[j] != 0; j++){
-                        //printf("wtf..\n");
-                        double t = 0;
-                        if (object_array[j] == object_array[best]){
-                            //printf("wtf..\n");
-                            continue;
-                        }
-                        switch(object_array[j]->kind) {
-                                //printf("switch..\n");
-                            case 0:
-                                // pass, it's a camera
-                                //printf("switch camera i:%d..\n", i);
-
-                                break;
-                            case 1:
-                                // intersectin test for sphere
-                                printf("switch. sphere.\n");
-                                t = sphere_intersection(ron, rdn,
-                                                        object_array[j]->sphere.position,
-                                                        object_array[j]->sphere.radius);
-                                break;
-                            case 2:
-                                printf("switch plane..\n");
-                                // intersection test for plane
-                                t = plane_intersection(ron, rdn,
-                                                       object_array[j]->plane.position,
-                                                       object_array[j]->plane.normal);
-                                break;
-                            case 3:
-                                printf("switch light..\n");
-                                // pass, it's a light
-                                break;
-                            default:
-                                printf("switch rip..\n");
-                                // rip
-                                exit(1);
-                        }
-                        
-                        
-                        if (t>0 && t<magnitude(rdn)){
-                            closest_shadow_object = 1;
-                            break;
-                        }
-                    }
-                    if (closest_shadow_object == 0){
-                        double N[3];
-                        if (object_array[best]->kind == 1){
-                            N[0] = ron[0] - object_array[best]->sphere.position[0];
-                            N[1] = ron[1] - object_array[best]->sphere.position[1];
-                            N[2] = ron[2] - object_array[best]->sphere.position[2];
-                        }
-                        else if (object_array[best]->kind == 2){
-                            N[0] = object_array[best]->plane.normal[0];
-                            N[1] = object_array[best]->plane.normal[1];
-                            N[2] = object_array[best]->plane.normal[2];
-                        }
-                        normalize(N);
-                        double L[3] = {rdn[0], rdn[1], rdn[2]};
-                        normalize(L);
-                        double nL[3] = {-L[0], -L[1], -L[2]};
-                        double R[3];
-                        reflect(L, N, R);
-                        double V[3] = {Rd[0], Rd[1], Rd[2]};
-                        double pos[3] = {lights[i]->light.position[0],
-                            lights[i]->light.position[1],
-                            lights[i]->light.position[2]};
-                        subtract(pos, ron);
-                        double d = magnitude(pos);
-                        double col;
-                        for (int c = 0; c < 3; c++) {
-                            col = 1;
-                            if (lights[i]->light.angular != INFINITY && lights[i]->light.theta != 0) {
-                                col *= fangular(nL, lights[i]->light.direction, lights[i]->light.angular, (lights[i]->light.theta)*0.0174533);
-                            }
-                            if (lights[i]->light.radial[0] != INFINITY) {
-                                col *= fradial(lights[i]->light.radial[2], lights[i]->light.radial[1], lights[i]->light.radial[0], d);
-                            }
-                            if (object_array[best]->kind == 1){
-                                col *= (diffuse_l(object_array[best]->sphere.diffuse[c], lights[i]->light.color[c], N, L) + (specular_l(object_array[best]->sphere.specular[c], lights[i]->light.color[c], V, R, N, L, 20)));
-                                color[c] += col;
-                            }
-                            else if (object_array[best]->kind == 2){
-                                col *= (diffuse_l(object_array[best]->plane.diffuse[c], lights[i]->light.color[c], N, L) + (specular_l(object_array[best]->plane.specular[c], lights[i]->light.color[c], V, R, N, L, 20)));
-                                color[c] += col;
-                            }
-                            color[c] = clamp(color[c]);
-                        }
-                    }
-                }
-            }
-            
-            Pixel new;
-            if (best_t > 0 && best_t != INFINITY) {
-                new.red = color[0];
-                new.green = color[1];
-                new.blue = color[2];
-                image[pixelNum] = new;
-                fprintf(output, "%i %i %i ", new.red, new.green, new.blue);
-                // reset color to be black
-                color[0] = 0;
-                color[1] = 0;
-                color[2] = 0;
-            } else {
-                // no object here, draw black pixel instead
-                image[pixelNum] = new;
-                fprintf(output, "0 0 0 ");
-            }
-            pixelNum++;
-        }
-    }
-    
-    fclose(output);
-    return 0;
-}
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <tgmath.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <stdarg.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// precision of the compiled scene and all ray math, double unless built
+// with -DREAL_FLOAT. the parser, timings and counters always use double.
+// math calls go through tgmath.h so they follow the type of their arguments
+#ifdef REAL_FLOAT
+typedef float real;
+// relative slack on bounding boxes, a few ulps of a real
+#define BOX_PAD 1e-6f
+#else
+typedef double real;
+#define BOX_PAD 1e-9
+#endif
+
+// pixel struct
+typedef struct Pixel{
+	unsigned char red;
+	unsigned char green;
+	unsigned char blue;
+} Pixel;
+
+// object struct
+typedef struct {
+    int kind;
+    union {
+        // camera
+        struct {
+            double width;
+            double height;
+        } camera;
+        // sphere
+        struct {
+            double position[3];
+            double radius;
+            double diffuse[3];
+            double specular[3];
+            double reflectivity;
+            double refractivity;
+            double ior;
+        } sphere;
+        // plane
+        struct {
+            double position[3];
+            double normal[3];
+            double diffuse[3];
+            double specular[3];
+            double reflectivity;
+            double refractivity;
+            double ior;
+        } plane;
+        // mesh, triangles loaded from an obj or binary mesh file
+        struct {
+            double position[3];  // added to every vertex after scaling
+            double scale;
+            double diffuse[3];
+            double specular[3];
+            double reflectivity;
+            double refractivity;
+            double ior;
+            char* file;          // path, relative ones resolved against the scene file
+            int vertex_count;    // filled in when the scene is compiled
+            int triangle_count;
+        } mesh;
+        // light
+        struct {
+            double position[3];
+            double color[3];
+            double theta;
+            double direction[3];
+            double radial[3];
+            double angular;
+        } light;
+    };
+} Object;
+
+
+// bump allocator; memory is handed out from large blocks and everything an
+// arena gave out is released together, so there is no per-object malloc
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+    size_t reserved;  // bytes held in blocks, including block headers
+} Arena;
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGN 32
+
+// bytes held by every arena right now and the most ever held at once
+size_t arena_current = 0;
+size_t arena_peak = 0;
+pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// zeroed, ARENA_ALIGN aligned memory that lives until the arena is released
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock* block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        // requests bigger than a block get one of their own, tucked behind
+        // the current block so it keeps serving small requests
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        size_t header = (sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        block = aligned_alloc(ARENA_ALIGN, header + capacity);
+        if (block == NULL) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            exit(1);
+        }
+        block->size = header + capacity;
+        block->used = header;
+        if (arena->head != NULL && size > ARENA_BLOCK_SIZE) {
+            block->next = arena->head->next;
+            arena->head->next = block;
+        } else {
+            block->next = arena->head;
+            arena->head = block;
+        }
+        arena->reserved += block->size;
+        pthread_mutex_lock(&arena_lock);
+        arena_current += block->size;
+        if (arena_current > arena_peak) arena_peak = arena_current;
+        pthread_mutex_unlock(&arena_lock);
+    }
+    void* memory = (char*)block + block->used;
+    block->used += size;
+    memset(memory, 0, size);
+    return memory;
+}
+
+// give back every block the arena holds
+void arena_release(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    pthread_mutex_lock(&arena_lock);
+    arena_current -= arena->reserved;
+    pthread_mutex_unlock(&arena_lock);
+    arena->head = NULL;
+    arena->reserved = 0;
+}
+
+// parsed objects and parser scratch, released once the scene is compiled
+Arena parse_arena;
+// the compiled scene, released at exit
+Arena scene_arena;
+
+// parsed objects are stored in fixed size chunks so the list can grow
+// without ever copying
+#define OBJECT_CHUNK 4096
+
+typedef struct ObjectChunk {
+    struct ObjectChunk* next;
+    int count;
+    Object objects[OBJECT_CHUNK];
+} ObjectChunk;
+
+typedef struct {
+    ObjectChunk* first;
+    ObjectChunk* last;
+    long count;
+} ObjectList;
+
+ObjectList objects;
+
+// append a zeroed object to the list
+Object* object_new() {
+    if (objects.last == NULL || objects.last->count == OBJECT_CHUNK) {
+        ObjectChunk* chunk = arena_alloc(&parse_arena, sizeof(ObjectChunk));
+        if (objects.last == NULL) {
+            objects.first = chunk;
+        } else {
+            objects.last->next = chunk;
+        }
+        objects.last = chunk;
+    }
+    objects.count++;
+    return &objects.last->objects[objects.last->count++];
+}
+
+// visit every parsed object in file order
+#define FOR_EACH_OBJECT(o) \
+    for (ObjectChunk* chunk_ = objects.first; chunk_ != NULL; chunk_ = chunk_->next) \
+        for (Object* o = chunk_->objects; o < chunk_->objects + chunk_->count; o++)
+// scene file mapped into memory; tokens are read in place and never copied
+typedef struct {
+    char* data;
+    char* pos;
+    char* end;
+    char* filename;
+} Parser;
+
+// report a parse error at the current position and give up; the line and
+// column are only worked out here so the fast path never counts newlines
+void parse_error(Parser* p, char* format, ...) {
+    int line = 1;
+    int column = 1;
+    for (char* s = p->data; s < p->pos && s < p->end; s++) {
+        if (*s == '\n') {
+            line++;
+            column = 1;
+        } else {
+            column++;
+        }
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, " on line %d, column %d of \"%s\".\n", line, column, p->filename);
+    va_end(args);
+    exit(1);
+}
+
+// next character from json file
+static inline int next_c(Parser* p) {
+    if (p->pos >= p->end) {
+        parse_error(p, "Unexpected end of file");
+    }
+    return *p->pos++;
+}
+
+static inline void expect_c(Parser* p, int d) {
+    if (p->pos >= p->end || *p->pos != d) {
+        parse_error(p, "Expected '%c'", d);
+    }
+    p->pos++;
+}
+
+// skip white space
+static inline void skip_ws(Parser* p) {
+    while (p->pos < p->end && isspace((unsigned char)*p->pos)) {
+        p->pos++;
+    }
+}
+
+// a string token pointing into the mapped file
+typedef struct {
+    char* start;
+    int length;
+} Token;
+
+// compare a token against a string literal
+#define TOKEN_IS(t, s) ((t).length == sizeof(s) - 1 && memcmp((t).start, s, sizeof(s) - 1) == 0)
+
+// get next string
+Token next_string(Parser* p) {
+    Token t;
+    if (p->pos >= p->end || *p->pos != '"') {
+        parse_error(p, "Expected string");
+    }
+    p->pos++;
+    t.start = p->pos;
+    while (1) {
+        if (p->pos >= p->end) {
+            parse_error(p, "Unexpected end of file");
+        }
+        int c = (unsigned char)*p->pos;
+        if (c == '"') {
+            break;
+        }
+        if (c == '\\') {
+            parse_error(p, "Strings with escape codes are not supported");
+        }
+        if (c < 32 || c > 126) {
+            parse_error(p, "Strings may contain only ascii characters");
+        }
+        p->pos++;
+    }
+    t.length = p->pos - t.start;
+    if (t.length > 128) {
+        parse_error(p, "Strings longer than 128 characters in length are not supported");
+    }
+    p->pos++;
+    return t;
+}
+
+// exactly representable powers of ten for the fast number path
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// get next number. the digits are gathered into an integer mantissa and a
+// decimal exponent; when the mantissa fits in 53 bits and the exponent is
+// within 10^22 a single multiply or divide rounds exactly like strtod, which
+// covers nearly every scene value. anything else is handed to strtod
+double next_number(Parser* p) {
+    char* start = p->pos;
+    char* s = p->pos;
+    int negative = 0;
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exact = 1;
+    int exponent = 0;
+    int seen = 0;
+
+    if (s < p->end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        s++;
+    }
+    while (s < p->end && isdigit((unsigned char)*s)) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            if (mantissa != 0) digits++;
+        } else {
+            exact = 0;
+        }
+        seen = 1;
+        s++;
+    }
+    if (s < p->end && *s == '.') {
+        s++;
+        while (s < p->end && isdigit((unsigned char)*s)) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                if (mantissa != 0) digits++;
+                exponent--;
+            } else {
+                exact = 0;
+            }
+            seen = 1;
+            s++;
+        }
+    }
+    if (!seen) {
+        parse_error(p, "Expected number");
+    }
+    if (s < p->end && (*s == 'e' || *s == 'E')) {
+        int sign = 1;
+        int value = 0;
+        s++;
+        if (s < p->end && (*s == '-' || *s == '+')) {
+            sign = *s == '-' ? -1 : 1;
+            s++;
+        }
+        if (s >= p->end || !isdigit((unsigned char)*s)) {
+            parse_error(p, "Malformed exponent");
+        }
+        while (s < p->end && isdigit((unsigned char)*s)) {
+            if (value < 10000) value = value * 10 + (*s - '0');
+            s++;
+        }
+        exponent += sign * value;
+    }
+    p->pos = s;
+
+    if (exact && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double)mantissa;
+        if (exponent < 0) {
+            value /= powers_of_ten[-exponent];
+        } else {
+            value *= powers_of_ten[exponent];
+        }
+        return negative ? -value : value;
+    }
+
+    // the mapped file isn't nul terminated, so strtod works on a copy
+    char buffer[128];
+    if (s - start >= (long)sizeof(buffer)) {
+        p->pos = start;
+        parse_error(p, "Number is too long");
+    }
+    memcpy(buffer, start, s - start);
+    buffer[s - start] = 0;
+    return strtod(buffer, NULL);
+}
+
+// get next vector
+void next_vector(Parser* p, double* v) {
+    expect_c(p, '[');
+    skip_ws(p);
+    v[0] = next_number(p);
+    skip_ws(p);
+    expect_c(p, ',');
+    skip_ws(p);
+    v[1] = next_number(p);
+    skip_ws(p);
+    expect_c(p, ',');
+    skip_ws(p);
+    v[2] = next_number(p);
+    skip_ws(p);
+    expect_c(p, ']');
+}
+
+// map a json file for parsing
+void parser_open(Parser* p, char* filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+    
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+        exit(1);
+    }
+    if (info.st_size == 0) {
+        fprintf(stderr, "Error: Scene file \"%s\" is empty.\n", filename);
+        exit(1);
+    }
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map file \"%s\"\n", filename);
+        exit(1);
+    }
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+    p->data = map;
+    p->pos = map;
+    p->end = p->data + info.st_size;
+    p->filename = filename;
+}
+
+void parser_close(Parser* p) {
+    munmap(p->data, p->end - p->data);
+}
+
+// a path named in a scene file, copied into the parse arena; relative
+// paths are taken from the directory the scene file is in
+char* scene_relative(char* scene_file, Token name) {
+    char* slash = strrchr(scene_file, '/');
+    int dir = name.length > 0 && name.start[0] != '/' && slash != NULL ? slash - scene_file + 1 : 0;
+    char* path = arena_alloc(&parse_arena, dir + name.length + 1);
+    memcpy(path, scene_file, dir);
+    memcpy(path + dir, name.start, name.length);
+    return path;
+}
+
+// read json file
+void read_scene(char* filename) {
+    int c;
+    Parser parser;
+    Parser* json = &parser;
+    parser_open(json, filename);
+    
+    skip_ws(json);
+    
+    // Find the beginning of the list
+    expect_c(json, '[');
+    
+    skip_ws(json);
+    
+    // Find the objects
+    
+    while (1) {
+        c = next_c(json);
+        if (c == ']') {
+            fprintf(stderr, "Error: This is the worst scene file EVER.\n");
+            parser_close(json);
+            return;
+        }
+        if (c == '{') {
+            skip_ws(json);
+            
+            // Parse the object
+            Token key = next_string(json);
+            if (!TOKEN_IS(key, "type")) {
+                parse_error(json, "Expected \"type\" key");
+            }
+            
+            skip_ws(json);
+            
+            expect_c(json, ':');
+            
+            skip_ws(json);
+            
+            Token value = next_string(json);
+            Object* current = object_new();
+            if (TOKEN_IS(value, "camera")) {
+                (*current).kind = 0;
+            } else if (TOKEN_IS(value, "sphere")) {
+                (*current).kind = 1;
+            } else if (TOKEN_IS(value, "plane")) {
+                (*current).kind = 2;
+            } else if (TOKEN_IS(value, "light")) {
+                (*current).kind = 3;
+            } else if (TOKEN_IS(value, "mesh")) {
+                (*current).kind = 4;
+                (*current).mesh.scale = 1;
+            } else {
+                parse_error(json, "Unknown type, \"%.*s\",", value.length, value.start);
+            }
+            
+            skip_ws(json);
+            
+            while (1) {
+                c = next_c(json);
+                if (c == '}') {
+                    // end of current object
+                    break;
+                } else if (c == ',') {
+                    // there are more objects to be read
+                    skip_ws(json);
+                    Token key = next_string(json);
+                    skip_ws(json);
+                    expect_c(json, ':');
+                    skip_ws(json);
+                    // check double field values
+                    if (TOKEN_IS(key, "width") ||
+                        TOKEN_IS(key, "height") ||
+                        TOKEN_IS(key, "radius") ||
+                        TOKEN_IS(key, "theta") ||
+                        TOKEN_IS(key, "radial-a2") ||
+                        TOKEN_IS(key, "radial-a1") ||
+                        TOKEN_IS(key, "radial-a0") ||
+                        TOKEN_IS(key, "angular-a0") ||
+                        TOKEN_IS(key, "reflectivity") ||
+                        TOKEN_IS(key, "refractivity") ||
+                        TOKEN_IS(key, "ior") ||
+                        TOKEN_IS(key, "scale")) {
+                        double value = next_number(json);
+                        if(TOKEN_IS(key, "width")){
+                            if((*current).kind == 0){
+                              (*current).camera.width = value;
+                            }
+                        }
+                        else if(TOKEN_IS(key, "height")){
+                            if((*current).kind == 0){
+                                (*current).camera.height = value;
+                            }
+                        }
+                        else if(TOKEN_IS(key, "radius")){
+                            (*current).sphere.radius = value;
+                        }
+                        else if(TOKEN_IS(key, "theta")) {
+                            (*current).light.theta = value;
+                        }
+                        else if(TOKEN_IS(key, "radial-a2")) {
+                            (*current).light.radial[2] = value;
+                        }
+                        else if(TOKEN_IS(key, "radial-a1")) {
+                            (*current).light.radial[1] = value;
+                        }
+                        else if(TOKEN_IS(key, "radial-a0")) {
+                            (*current).light.radial[0] = value;
+                        }
+                        else if(TOKEN_IS(key, "angular-a0")) {
+                            (*current).light.angular = value;
+                        }
+                        else if(TOKEN_IS(key, "reflectivity")) {
+                            if((*current).kind == 1){
+                                (*current).sphere.reflectivity = value;
+                            }
+                            else if((*current).kind == 2){
+                                (*current).plane.reflectivity = value;
+                            }
+                            else if((*current).kind == 4){
+                                (*current).mesh.reflectivity = value;
+                            }
+                        }
+                        else if(TOKEN_IS(key, "refractivity")) {
+                            if((*current).kind == 1){
+                                (*current).sphere.refractivity = value;
+                            }
+                            else if((*current).kind == 2){
+                                (*current).plane.refractivity = value;
+                            }
+                            else if((*current).kind == 4){
+                                (*current).mesh.refractivity = value;
+                            }
+                        }
+                        else if(TOKEN_IS(key, "ior")) {
+                            if((*current).kind == 1){
+                                (*current).sphere.ior = value;
+                            }
+                            else if((*current).kind == 2){
+                                (*current).plane.ior = value;
+                            }
+                            else if((*current).kind == 4){
+                                (*current).mesh.ior = value;
+                            }
+                        }
+                        else if(TOKEN_IS(key, "scale")) {
+                            if((*current).kind == 4){
+                                (*current).mesh.scale = value;
+                            }
+                        }
+                        // check object string values
+                    } else if (TOKEN_IS(key, "file")) {
+                        Token file = next_string(json);
+                        if((*current).kind == 4){
+                            (*current).mesh.file = scene_relative(filename, file);
+                        }
+                        // check object vector values
+                    } else if (TOKEN_IS(key, "color") ||
+                               TOKEN_IS(key, "position") ||
+                               TOKEN_IS(key, "normal") ||
+                               TOKEN_IS(key, "diffuse_color") ||
+                               TOKEN_IS(key, "specular_color") ||
+                               TOKEN_IS(key, "direction")) {
+                        double value[3];
+                        next_vector(json, value);
+                        if(TOKEN_IS(key, "color")){
+                            (*current).light.color[0] = value[0];
+                            (*current).light.color[1] = value[1];
+                            (*current).light.color[2] = value[2];
+                        }
+                        else if(TOKEN_IS(key, "position")){
+                            if((*current).kind == 1){
+                                (*current).sphere.position[0] = value[0];
+                                (*current).sphere.position[1] = value[1];
+                                (*current).sphere.position[2] = value[2];
+                            }
+                            else if((*current).kind == 2){
+                                (*current).plane.position[0] = value[0];
+                                (*current).plane.position[1] = value[1];
+                                (*current).plane.position[2] = value[2];
+                            }
+                            else if((*current).kind == 4){
+                                (*current).mesh.position[0] = value[0];
+                                (*current).mesh.position[1] = value[1];
+                                (*current).mesh.position[2] = value[2];
+                            }
+                            else if((*current).kind == 3){
+                                (*current).light.position[0] = value[0];
+                                (*current).light.position[1] = value[1];
+                                (*current).light.position[2] = value[2];
+                            }
+                        }
+                        else if(TOKEN_IS(key, "normal")){
+                            (*current).plane.normal[0] = value[0];
+                            (*current).plane.normal[1] = value[1];
+                            (*current).plane.normal[2] = value[2];
+                        }
+                        else if(TOKEN_IS(key, "diffuse_color")){
+                            if((*current).kind == 1){
+                                (*current).sphere.diffuse[0] = value[0];
+                                (*current).sphere.diffuse[1] = value[1];
+                                (*current).sphere.diffuse[2] = value[2];
+                            }
+                            else if((*current).kind == 2){
+                                (*current).plane.diffuse[0] = value[0];
+                                (*current).plane.diffuse[1] = value[1];
+                                (*current).plane.diffuse[2] = value[2];
+                            }
+                            else if((*current).kind == 4){
+                                (*current).mesh.diffuse[0] = value[0];
+                                (*current).mesh.diffuse[1] = value[1];
+                                (*current).mesh.diffuse[2] = value[2];
+                            }
+                        }
+                        else if(TOKEN_IS(key, "specular_color")){
+                            if((*current).kind == 1){
+                                (*current).sphere.specular[0] = value[0];
+                                (*current).sphere.specular[1] = value[1];
+                                (*current).sphere.specular[2] = value[2];
+                            }
+                            else if((*current).kind == 2){
+                                (*current).plane.specular[0] = value[0];
+                                (*current).plane.specular[1] = value[1];
+                                (*current).plane.specular[2] = value[2];
+                            }
+                            else if((*current).kind == 4){
+                                (*current).mesh.specular[0] = value[0];
+                                (*current).mesh.specular[1] = value[1];
+                                (*current).mesh.specular[2] = value[2];
+                            }
+                        }
+                        else if(TOKEN_IS(key, "direction")) {
+                            (*current).light.direction[0] = value[0];
+                            (*current).light.direction[1] = value[1];
+                            (*current).light.direction[2] = value[2];
+                        }
+                    } else {
+                        parse_error(json, "Unknown property, \"%.*s\",", key.length, key.start);
+                    }
+                    skip_ws(json);
+                } else {
+                    json->pos--;
+                    parse_error(json, "Unexpected value");
+                }
+            }
+            skip_ws(json);
+            c = next_c(json);
+            if (c == ',') {
+                skip_ws(json);
+            } else if (c == ']') {
+                parser_close(json);
+                return;
+            } else {
+                json->pos--;
+                parse_error(json, "Expecting ',' or ']'");
+            }
+        } else {
+            json->pos--;
+            parse_error(json, "Expected '{'");
+        }
+    }
+}
+
+// phong exponent of every material's specular highlight
+#define SPECULAR_EXPONENT 20
+
+// material shared by spheres and planes; whatever light is not reflected
+// or refracted is shaded locally
+typedef struct {
+    real diffuse[3];
+    real specular[3];
+    real reflectivity;
+    real refractivity;
+    real ior;
+    int shininess;  // specular exponent, raised by repeated multiplication
+    int glossy;     // some specular channel is above 0
+} Material;
+
+// light kinds, picking the shading kernel
+#define LIGHT_SPOT 1        // lit only inside a cone, falling off with angular
+#define LIGHT_ATTENUATED 2  // falls off with distance through radial
+
+// light copied out of the object list, with what shading needs worked out
+// once by bake_light()
+typedef struct {
+    real position[3];
+    real color[3];
+    real direction[3];
+    real radial[3];
+    real theta;
+    real angular;
+    int kind;
+    real axis[3];     // direction normalized
+    real cos_cutoff;  // points whose cosine to the axis is under this are outside the cone
+} Light;
+
+// bounding volume hierarchy node; inner nodes have count 0 and their
+// children at first and first + 1, leaves cover spheres (or triangles
+// in the triangle tree) first .. first+count-1
+typedef struct {
+    real min[3];
+    real max[3];
+    int first;
+    int count;
+} BVHNode;
+
+// compiled scene; cameras and lights are pulled out and the primitives are
+// packed into separate arrays per field so the intersection loops stream
+// through contiguous memory without switching on kind. object ids are
+// 0 .. sphere_count-1 for spheres followed by the planes, then the
+// triangles of every mesh
+typedef struct {
+    real camera_width;
+    real camera_height;
+
+    int sphere_count;
+    real* sphere_center[3];
+    real* sphere_r2;
+    int* sphere_material;
+    int* sphere_slot;  // index into the sphere arrays of each sphere in file order
+
+    int plane_count;
+    real* plane_point[3];
+    real* plane_normal[3];
+    int* plane_material;
+
+    // every mesh shares one vertex buffer and one index buffer; triangles
+    // are kept in the order of their own bvh
+    int mesh_vertex_count;
+    real* mesh_vertex;      // 3 per vertex
+    int triangle_count;
+    int* triangle_vertex;   // 3 vertex indexes per triangle
+    int* triangle_material;
+    int triangle_node_count;
+    BVHNode* triangle_nodes;
+    char* mesh_files;       // nul terminated paths the meshes were read from
+    size_t mesh_files_size;
+
+    int material_count;
+    Material* materials;
+
+    int light_count;
+    Light* lights;
+} Scene;
+
+Scene scene;
+
+// number of primitives the packet kernels test against one ray at once,
+// one avx register of reals
+#ifdef REAL_FLOAT
+#define SIMD_WIDTH 8
+#else
+#define SIMD_WIDTH 4
+#endif
+
+// avx operations on a register of reals, V(add) is _mm256_add_pd or _ps
+#ifdef __AVX2__
+#ifdef REAL_FLOAT
+typedef __m256 vreal;
+#define V(op) _mm256_##op##_ps
+#else
+typedef __m256d vreal;
+#define V(op) _mm256_##op##_pd
+#endif
+#endif
+
+// square root
+static inline real sqr(real v) {
+    return v*v;
+}
+
+// normalize a vector
+static inline void normalize(real* v) {
+    real len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+    v[0] /= len;
+    v[1] /= len;
+    v[2] /= len;
+}
+
+// compute dot product of two vectors
+real dot(real* a, real* b) {
+    real result;
+    result = a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+    return result;
+}
+
+// calculate magnitude of vector
+real magnitude(real* v){
+    return sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+}
+
+// scale vector by s
+void scale(real* v, real s){
+    v[0] *= s;
+    v[1] *= s;
+    v[2] *= s;
+}
+
+// subtract two vectors
+void subtract(real* v1, real* v2){
+    v1[0] -= v2[0];
+    v1[1] -= v2[1];
+    v1[2] -= v2[2];
+}
+
+// calculate reflection vector
+void reflect(real* v, real* n, real* r){
+    real dotResult = dot(v, n);
+    dotResult *= 2;
+    real nNew[3] = {
+        n[0],
+        n[1],
+        n[2]
+    };
+    scale(nNew, dotResult);
+    r[0] = v[0];
+    r[1] = v[1];
+    r[2] = v[2];
+    subtract(r, nNew);
+}
+
+// scale a color value like clamp() but let it go over 255, for float images
+real unclamped(real number) {
+    number *= 255;
+    return number < 0 ? 0 : number;
+}
+
+// clamp our color values
+real clamp(real number){
+    number *= 255;
+    if (number < 0) {
+        return 0;
+    }
+    else if (number > 255){
+        return 255;
+    }
+    else {
+        return number;
+    }
+}
+
+// work out a light's kind, cone axis and cone cosine, again whenever its
+// fields change
+void bake_light(Light* l) {
+    l->kind = 0;
+    if (l->angular != INFINITY && l->theta != 0) l->kind |= LIGHT_SPOT;
+    if (l->radial[0] != INFINITY) l->kind |= LIGHT_ATTENUATED;
+    real length = magnitude(l->direction);
+    for (int k = 0; k < 3; k++) {
+        l->axis[k] = length > 0 ? l->direction[k] / length : 0;
+    }
+    // theta is the full cone angle in degrees; a cone of 360 or more lets
+    // everything through and a negative one nothing
+    real half = (l->theta)*0.0174533 / 2;
+    if (half >= M_PI) {
+        l->cos_cutoff = -INFINITY;
+    } else if (half < 0) {
+        l->cos_cutoff = INFINITY;
+    } else {
+        l->cos_cutoff = cos(half);
+    }
+}
+
+// go through objects and copy lights into the scene
+void collect_lights (){
+    scene.light_count = 0;
+    FOR_EACH_OBJECT(o) {
+        if (o->kind == 3){
+            scene.light_count++;
+        }
+    }
+    scene.lights = arena_alloc(&scene_arena, sizeof(Light)*(scene.light_count + 1));
+    int light = 0;
+    FOR_EACH_OBJECT(o) {
+        if (o->kind == 3){
+            Light* l = &scene.lights[light++];
+            for (int k = 0; k < 3; k++) {
+                l->position[k] = o->light.position[k];
+                l->color[k] = o->light.color[k];
+                l->direction[k] = o->light.direction[k];
+                l->radial[k] = o->light.radial[k];
+            }
+            l->theta = o->light.theta;
+            l->angular = o->light.angular;
+            bake_light(l);
+        }
+    }
+}
+
+// fill in how much light a material reflects and refracts; an unset index
+// of refraction means 1
+void set_transport(Material* m, double reflectivity, double refractivity, double ior) {
+    if (reflectivity < 0 || refractivity < 0 || reflectivity + refractivity > 1) {
+        fprintf(stderr, "Error: Reflectivity and refractivity must be positive and add up to at most 1.\n");
+        exit(1);
+    }
+    if (ior < 0) {
+        fprintf(stderr, "Error: Index of refraction must be positive.\n");
+        exit(1);
+    }
+    m->reflectivity = reflectivity;
+    m->refractivity = refractivity;
+    m->ior = ior > 0 ? ior : 1;
+}
+
+// fill in the specular exponent and whether the specular term can be skipped
+void bake_material(Material* m) {
+    m->shininess = SPECULAR_EXPONENT;
+    m->glossy = m->specular[0] > 0 || m->specular[1] > 0 || m->specular[2] > 0;
+}
+
+// binary mesh files start with this header, followed by vertex_count
+// vertices of 3 floats and triangle_count triangles of 3 zero based vertex
+// indexes as unsigned 32 bit integers, all in native byte order
+#define MESH_MAGIC "RTMESH1"
+
+typedef struct {
+    char magic[8];
+    unsigned int vertex_count;
+    unsigned int triangle_count;
+} MeshHeader;
+
+// most vertices or triangles all meshes together may have, so every
+// index into the 3 per element buffers fits in an int
+#define MESH_MAX_COUNT (INT_MAX / 3)
+
+// skip spaces and tabs, stopping at the end of the line
+static inline void skip_blank(Parser* p) {
+    while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t')) {
+        p->pos++;
+    }
+}
+
+static inline int at_line_end(Parser* p) {
+    return p->pos >= p->end || *p->pos == '\n' || *p->pos == '\r' || *p->pos == '#';
+}
+
+// true if the line at the parser starts with the obj keyword c
+static inline int obj_keyword(Parser* p, char c) {
+    return p->end - p->pos >= 2 && p->pos[0] == c && (p->pos[1] == ' ' || p->pos[1] == '\t');
+}
+
+// map a binary or obj mesh file and count its vertices and triangles; unless
+// vertex is NULL they are also stored in vertex and triangle. obj polygons
+// are split into fans of triangles, and normals, texture coordinates,
+// groups and materials are ignored
+void read_mesh(char* path, real* vertex, int* triangle, int* vertex_count, int* triangle_count) {
+    struct stat info;
+    if (stat(path, &info) == 0 && info.st_size == 0) {
+        fprintf(stderr, "Error: Mesh file \"%s\" is empty.\n", path);
+        exit(1);
+    }
+    Parser parser;
+    Parser* p = &parser;
+    parser_open(p, path);
+    size_t size = p->end - p->data;
+
+    MeshHeader header;
+    if (size >= sizeof(header) && memcmp(p->data, MESH_MAGIC, sizeof(MESH_MAGIC)) == 0) {
+        memcpy(&header, p->data, sizeof(header));
+        if (header.vertex_count > MESH_MAX_COUNT || header.triangle_count > MESH_MAX_COUNT ||
+            size != sizeof(header) + 12*((size_t)header.vertex_count + header.triangle_count)) {
+            fprintf(stderr, "Error: Mesh file \"%s\" is truncated or corrupt.\n", path);
+            exit(1);
+        }
+        *vertex_count = header.vertex_count;
+        *triangle_count = header.triangle_count;
+        if (vertex != NULL) {
+            // the header keeps both arrays 4 byte aligned in the mapping
+            float* v = (float*)(p->data + sizeof(header));
+            unsigned int* t = (unsigned int*)(v + 3*(size_t)header.vertex_count);
+            for (size_t i = 0; i < 3*(size_t)header.vertex_count; i++) {
+                vertex[i] = v[i];
+            }
+            for (size_t i = 0; i < 3*(size_t)header.triangle_count; i++) {
+                if (t[i] >= header.vertex_count) {
+                    fprintf(stderr, "Error: Mesh file \"%s\" has a vertex index out of range.\n", path);
+                    exit(1);
+                }
+                triangle[i] = t[i];
+            }
+        }
+        parser_close(p);
+        return;
+    }
+
+    int vertices = 0;
+    int triangles = 0;
+    while (p->pos < p->end) {
+        skip_blank(p);
+        if (obj_keyword(p, 'v')) {
+            p->pos++;
+            if (vertices == MESH_MAX_COUNT) {
+                parse_error(p, "Too many vertices");
+            }
+            for (int k = 0; k < 3; k++) {
+                skip_blank(p);
+                double value = next_number(p);
+                if (vertex != NULL) vertex[3*(size_t)vertices + k] = value;
+            }
+            vertices++;
+        } else if (obj_keyword(p, 'f')) {
+            p->pos++;
+            int corners = 0;
+            int first = 0;
+            int previous = 0;
+            while (skip_blank(p), !at_line_end(p)) {
+                // indexes count from 1, or back from the last vertex when negative
+                double value = next_number(p);
+                if (value != floor(value) || value == 0 || fabs(value) > vertices) {
+                    parse_error(p, "Face refers to a missing vertex");
+                }
+                int index = value < 0 ? vertices + (int)value : (int)value - 1;
+                // v/vt/vn corners only use the vertex
+                while (p->pos < p->end && !isspace((unsigned char)*p->pos)) {
+                    p->pos++;
+                }
+                if (corners == 0) {
+                    first = index;
+                } else if (corners >= 2) {
+                    if (triangles == MESH_MAX_COUNT) {
+                        parse_error(p, "Too many triangles");
+                    }
+                    if (triangle != NULL) {
+                        int* t = &triangle[3*(size_t)triangles];
+                        t[0] = first;
+                        t[1] = previous;
+                        t[2] = index;
+                    }
+                    triangles++;
+                }
+                previous = index;
+                corners++;
+            }
+            if (corners < 3) {
+                parse_error(p, "Faces need at least three vertices");
+            }
+        }
+        // the rest of the line, or the whole of one this doesn't use
+        while (p->pos < p->end && *p->pos != '\n') {
+            p->pos++;
+        }
+        if (p->pos < p->end) p->pos++;
+    }
+    *vertex_count = vertices;
+    *triangle_count = triangles;
+    parser_close(p);
+}
+
+// pack cameras, spheres, planes and meshes from the object list into the scene
+void compile_scene() {
+    int camera = 0;
+    int meshes = 0;
+    long vertices = 0;
+    long triangles = 0;
+    size_t files = 0;
+    scene.sphere_count = 0;
+    scene.plane_count = 0;
+    FOR_EACH_OBJECT(o) {
+        if (o->kind == 0 && !camera) {
+            scene.camera_width = o->camera.width;
+            scene.camera_height = o->camera.height;
+            camera = 1;
+        }
+        if (o->kind == 1) scene.sphere_count++;
+        if (o->kind == 2) scene.plane_count++;
+        if (o->kind == 4) {
+            if (o->mesh.file == NULL) {
+                fprintf(stderr, "Error: Mesh has no \"file\".\n");
+                exit(1);
+            }
+            // a first pass over each file only counts, so the buffers
+            // can be allocated once at their full size
+            read_mesh(o->mesh.file, NULL, NULL, &o->mesh.vertex_count, &o->mesh.triangle_count);
+            vertices += o->mesh.vertex_count;
+            triangles += o->mesh.triangle_count;
+            files += strlen(o->mesh.file) + 1;
+            meshes++;
+        }
+    }
+    if (!camera) {
+        fprintf(stderr, "Error: Scene has no camera.\n");
+        exit(1);
+    }
+    if (vertices > MESH_MAX_COUNT || triangles > MESH_MAX_COUNT ||
+        triangles + scene.sphere_count + scene.plane_count > INT_MAX) {
+        fprintf(stderr, "Error: Meshes have too many triangles.\n");
+        exit(1);
+    }
+    scene.mesh_vertex_count = vertices;
+    scene.triangle_count = triangles;
+    scene.mesh_files_size = files;
+
+    // the primitive arrays are padded so the simd kernels can always load
+    // a full group of lanes
+    size_t spheres = scene.sphere_count + SIMD_WIDTH;
+    size_t planes = scene.plane_count + SIMD_WIDTH;
+    for (int k = 0; k < 3; k++) {
+        scene.sphere_center[k] = arena_alloc(&scene_arena, sizeof(real)*spheres);
+        scene.plane_point[k] = arena_alloc(&scene_arena, sizeof(real)*planes);
+        scene.plane_normal[k] = arena_alloc(&scene_arena, sizeof(real)*planes);
+    }
+    scene.sphere_r2 = arena_alloc(&scene_arena, sizeof(real)*spheres);
+    scene.sphere_material = arena_alloc(&scene_arena, sizeof(int)*spheres);
+    scene.plane_material = arena_alloc(&scene_arena, sizeof(int)*planes);
+    scene.materials = arena_alloc(&scene_arena, sizeof(Material)*(spheres + planes + meshes));
+    // padded triangles point at vertex 0, so a packet can read them too
+    scene.mesh_vertex = arena_alloc(&scene_arena, sizeof(real)*3*(vertices + 1));
+    scene.triangle_vertex = arena_alloc(&scene_arena, sizeof(int)*3*(triangles + SIMD_WIDTH));
+    scene.triangle_material = arena_alloc(&scene_arena, sizeof(int)*(triangles + SIMD_WIDTH));
+    scene.mesh_files = arena_alloc(&scene_arena, files + 1);
+
+    int s = 0;
+    int p = 0;
+    int v = 0;
+    int t = 0;
+    files = 0;
+    scene.material_count = 0;
+    FOR_EACH_OBJECT(o) {
+        Material* m = &scene.materials[scene.material_count];
+        if (o->kind == 1) {
+            for (int k = 0; k < 3; k++) {
+                scene.sphere_center[k][s] = o->sphere.position[k];
+                m->diffuse[k] = o->sphere.diffuse[k];
+                m->specular[k] = o->sphere.specular[k];
+            }
+            scene.sphere_r2[s] = sqr(o->sphere.radius);
+            set_transport(m, o->sphere.reflectivity, o->sphere.refractivity, o->sphere.ior);
+            bake_material(m);
+            scene.sphere_material[s++] = scene.material_count++;
+        } else if (o->kind == 2) {
+            real normal[3] = {o->plane.normal[0], o->plane.normal[1], o->plane.normal[2]};
+            normalize(normal);
+            for (int k = 0; k < 3; k++) {
+                scene.plane_point[k][p] = o->plane.position[k];
+                scene.plane_normal[k][p] = normal[k];
+                m->diffuse[k] = o->plane.diffuse[k];
+                m->specular[k] = o->plane.specular[k];
+            }
+            set_transport(m, o->plane.reflectivity, o->plane.refractivity, o->plane.ior);
+            bake_material(m);
+            scene.plane_material[p++] = scene.material_count++;
+        } else if (o->kind == 4) {
+            real* vertex = &scene.mesh_vertex[3*(size_t)v];
+            int* triangle = &scene.triangle_vertex[3*(size_t)t];
+            int vertex_count;
+            int triangle_count;
+            read_mesh(o->mesh.file, vertex, triangle, &vertex_count, &triangle_count);
+            if (vertex_count != o->mesh.vertex_count || triangle_count != o->mesh.triangle_count) {
+                fprintf(stderr, "Error: Mesh file \"%s\" changed while it was read.\n", o->mesh.file);
+                exit(1);
+            }
+            for (size_t i = 0; i < 3*(size_t)vertex_count; i++) {
+                vertex[i] = o->mesh.scale * vertex[i] + o->mesh.position[i % 3];
+            }
+            // indexes into the shared vertex buffer
+            for (size_t i = 0; i < 3*(size_t)triangle_count; i++) {
+                triangle[i] += v;
+            }
+            for (int k = 0; k < 3; k++) {
+                m->diffuse[k] = o->mesh.diffuse[k];
+                m->specular[k] = o->mesh.specular[k];
+            }
+            set_transport(m, o->mesh.reflectivity, o->mesh.refractivity, o->mesh.ior);
+            bake_material(m);
+            for (int i = 0; i < triangle_count; i++) {
+                scene.triangle_material[t + i] = scene.material_count;
+            }
+            scene.material_count++;
+            strcpy(scene.mesh_files + files, o->mesh.file);
+            files += strlen(o->mesh.file) + 1;
+            v += vertex_count;
+            t += triangle_count;
+        }
+    }
+}
+
+// radial light equation
+real fradial(real a2, real a1, real a0, real d) {
+    real quotient = a2 * sqr(d) + a1 * d + a0;
+    if (quotient == 0) {
+        return 0;
+    }
+    if (d == INFINITY) {
+        return 1;
+    } else {
+        return 1.0 / quotient;
+    }
+}
+
+// x to a whole power n >= 0 by squaring
+static inline real power(real x, int n) {
+    real result = 1;
+    while (n > 0) {
+        if (n & 1) result *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+// intersection of ray and sphere object
+real sphere_intersection(real* Ro, real* Rd,
+                           real* C, real r2) {
+    real a = (sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
+    real b = (2*(Ro[0]*Rd[0] - Rd[0]*C[0] + Ro[1]*Rd[1] - Rd[1]*C[1] + Ro[2]*Rd[2] - Rd[2]*C[2]));
+    real c = sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0]) + sqr(Ro[1]) - 2*Ro[1]*C[1] + sqr(C[1]) + sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2]) - r2;
+    
+    real det = sqr(b) - 4 * a * c;
+    if (det < 0) return -1;
+    
+    det = sqrt(det);
+    
+    real t0 = (-b - det) / (2*a);
+    if (t0 > 0) return t0;
+    
+    real t1 = (-b + det) / (2*a);
+    if (t1 > 0) return t1;
+    
+    return -1;
+    
+}
+
+// intersection of ray and plane object
+real plane_intersection(real* Ro, real* Rd,
+                          real* C, real* N) {
+    real subtract[3];
+    subtract[0] = C[0]-Ro[0];
+    subtract[1] = C[1]-Ro[1];
+    subtract[2] = C[2]-Ro[2];
+    real dot1 = N[0]*subtract[0] + N[1]*subtract[1] + N[2]*subtract[2];
+    real dot2 = N[0]*Rd[0] + N[1]*Rd[1] + N[2]*Rd[2];
+    
+    return dot1/dot2;
+}
+
+// seconds on a monotonic clock
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// render counters; every thread keeps its own copy in its Tracer and they
+// are summed once the thread finishes, so counting never contends
+typedef struct {
+    long long primary_rays;
+    long long shadow_rays;
+    long long box_tests;
+    long long sphere_tests;
+    long long plane_tests;
+    long long triangle_tests;
+    long long occluded;        // shadow rays that found a blocker
+    long long lit;             // shadow rays that reached their light
+    long long occluder_cache_hits;
+    long long antialiased_pixels;  // edge pixels that were supersampled
+    long long secondary_rays;      // reflection and refraction rays
+    long long culled_lights;       // lights skipped at a hit without a shadow ray
+    long long reused_pixels;       // first pass colors kept from a g-buffer
+    long long relit_pixels;        // shaded again for only the changed lights
+    long long reshaded_pixels;     // traced again from a g-buffer's hits
+    double trace_seconds;      // finding the closest hits, summed over threads
+    double shade_seconds;      // shadow rays and lighting, summed over threads
+} Stats;
+
+// building with -DNO_STATS compiles every counter and per pixel clock away
+#ifdef NO_STATS
+#define STATS_ENABLED 0
+#define STAT_ADD(stats, field, n) ((void)(stats))
+#define STAT_CLOCK(on) 0.0
+#define STAT_SPAN(stats, field, from, to) ((void)(from), (void)(to))
+#else
+#define STATS_ENABLED 1
+#define STAT_ADD(stats, field, n) ((stats)->field += (n))
+// the clock is only read when timings were asked for
+#define STAT_CLOCK(on) ((on) ? now_seconds() : 0.0)
+#define STAT_SPAN(stats, field, from, to) ((stats)->field += (to) - (from))
+#endif
+
+void stats_merge(Stats* into, Stats* from) {
+    into->primary_rays += from->primary_rays;
+    into->shadow_rays += from->shadow_rays;
+    into->box_tests += from->box_tests;
+    into->sphere_tests += from->sphere_tests;
+    into->plane_tests += from->plane_tests;
+    into->triangle_tests += from->triangle_tests;
+    into->occluded += from->occluded;
+    into->lit += from->lit;
+    into->occluder_cache_hits += from->occluder_cache_hits;
+    into->antialiased_pixels += from->antialiased_pixels;
+    into->secondary_rays += from->secondary_rays;
+    into->culled_lights += from->culled_lights;
+    into->reused_pixels += from->reused_pixels;
+    into->relit_pixels += from->relit_pixels;
+    into->reshaded_pixels += from->reshaded_pixels;
+    into->trace_seconds += from->trace_seconds;
+    into->shade_seconds += from->shade_seconds;
+}
+
+// wall clock seconds spent in each phase of a run
+#define PHASE_PARSE 0
+#define PHASE_SETUP 1
+#define PHASE_RENDER 2
+#define PHASE_WRITE 3
+#define PHASE_COUNT 4
+
+double phase_seconds[PHASE_COUNT];
+
+// distance along the ray to sphere s
+static inline real sphere_hit(int s, real* Ro, real* Rd) {
+    real C[3] = {
+        scene.sphere_center[0][s],
+        scene.sphere_center[1][s],
+        scene.sphere_center[2][s]
+    };
+    return sphere_intersection(Ro, Rd, C, scene.sphere_r2[s]);
+}
+
+// distance along the ray to plane p
+static inline real plane_hit(int p, real* Ro, real* Rd) {
+    real C[3] = {
+        scene.plane_point[0][p],
+        scene.plane_point[1][p],
+        scene.plane_point[2][p]
+    };
+    real N[3] = {
+        scene.plane_normal[0][p],
+        scene.plane_normal[1][p],
+        scene.plane_normal[2][p]
+    };
+    return plane_intersection(Ro, Rd, C, N);
+}
+
+// distance along the ray to triangle t, -1 on a miss. moller-trumbore: the
+// hit is solved for in barycentric coordinates u and v straight from the
+// shared vertices, so nothing per triangle is stored but its indexes. a ray
+// in the triangle's plane divides by zero, and the resulting inf or NaN
+// fails the tests
+static inline real triangle_hit(int t, real* Ro, real* Rd) {
+    int* index = &scene.triangle_vertex[3*(size_t)t];
+    real* a = &scene.mesh_vertex[3*(size_t)index[0]];
+    real* b = &scene.mesh_vertex[3*(size_t)index[1]];
+    real* c = &scene.mesh_vertex[3*(size_t)index[2]];
+    real e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    real e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    real s[3] = {Ro[0] - a[0], Ro[1] - a[1], Ro[2] - a[2]};
+    real p[3] = {
+        Rd[1]*e2[2] - Rd[2]*e2[1],
+        Rd[2]*e2[0] - Rd[0]*e2[2],
+        Rd[0]*e2[1] - Rd[1]*e2[0]
+    };
+    real q[3] = {
+        s[1]*e1[2] - s[2]*e1[1],
+        s[2]*e1[0] - s[0]*e1[2],
+        s[0]*e1[1] - s[1]*e1[0]
+    };
+    real inv = 1 / dot(e1, p);
+    real u = dot(s, p) * inv;
+    real v = dot(Rd, q) * inv;
+    real d = dot(e2, q) * inv;
+    if (u >= 0 && v >= 0 && u + v <= 1 && d > 0) {
+        return d;
+    }
+    return -1;
+}
+
+// distance along the ray to any object id
+static inline real object_intersection(int id, real* Ro, real* Rd) {
+    if (id < scene.sphere_count) {
+        return sphere_hit(id, Ro, Rd);
+    }
+    if (id < scene.sphere_count + scene.plane_count) {
+        return plane_hit(id - scene.sphere_count, Ro, Rd);
+    }
+    return triangle_hit(id - scene.sphere_count - scene.plane_count, Ro, Rd);
+}
+
+// intersect one ray with spheres s .. s+SIMD_WIDTH-1, storing each lane's
+// distance in t (-1 on a miss) and returning a bitmask of lanes with
+// 0 < t < tmax. the arithmetic follows sphere_intersection() operation for
+// operation so both paths give bit identical distances
+static inline int sphere_hit_packet(int s, real* Ro, real* Rd, real tmax, real* t) {
+#ifdef __AVX2__
+    vreal cx = V(loadu)(&scene.sphere_center[0][s]);
+    vreal cy = V(loadu)(&scene.sphere_center[1][s]);
+    vreal cz = V(loadu)(&scene.sphere_center[2][s]);
+    vreal r2 = V(loadu)(&scene.sphere_r2[s]);
+    vreal dx = V(set1)(Rd[0]);
+    vreal dy = V(set1)(Rd[1]);
+    vreal dz = V(set1)(Rd[2]);
+    real a = (sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
+
+    vreal b = V(sub)(V(set1)(Ro[0]*Rd[0]), V(mul)(dx, cx));
+    b = V(add)(b, V(set1)(Ro[1]*Rd[1]));
+    b = V(sub)(b, V(mul)(dy, cy));
+    b = V(add)(b, V(set1)(Ro[2]*Rd[2]));
+    b = V(sub)(b, V(mul)(dz, cz));
+    b = V(mul)(V(set1)(2), b);
+
+    vreal c = V(sub)(V(set1)(sqr(Ro[0])), V(mul)(V(set1)(2*Ro[0]), cx));
+    c = V(add)(c, V(mul)(cx, cx));
+    c = V(add)(c, V(set1)(sqr(Ro[1])));
+    c = V(sub)(c, V(mul)(V(set1)(2*Ro[1]), cy));
+    c = V(add)(c, V(mul)(cy, cy));
+    c = V(add)(c, V(set1)(sqr(Ro[2])));
+    c = V(sub)(c, V(mul)(V(set1)(2*Ro[2]), cz));
+    c = V(add)(c, V(mul)(cz, cz));
+    c = V(sub)(c, r2);
+
+    // a negative determinant turns into NaN here, which fails both tests below
+    vreal det = V(sub)(V(mul)(b, b), V(mul)(V(set1)(4 * a), c));
+    det = V(sqrt)(det);
+    vreal negb = V(xor)(b, V(set1)(-0.0));
+    vreal twoa = V(set1)(2*a);
+    vreal t0 = V(div)(V(sub)(negb, det), twoa);
+    vreal t1 = V(div)(V(add)(negb, det), twoa);
+    vreal zero = V(setzero)();
+    vreal miss = V(set1)(-1);
+    vreal result = V(blendv)(miss, t1, V(cmp)(t1, zero, _CMP_GT_OQ));
+    result = V(blendv)(result, t0, V(cmp)(t0, zero, _CMP_GT_OQ));
+    V(storeu)(t, result);
+    vreal hit = V(and)(V(cmp)(result, zero, _CMP_GT_OQ),
+                       V(cmp)(result, V(set1)(tmax), _CMP_LT_OQ));
+    return V(movemask)(hit);
+#else
+    int mask = 0;
+    for (int k = 0; k < SIMD_WIDTH; k++) {
+        t[k] = sphere_hit(s + k, Ro, Rd);
+        if (t[k] > 0 && t[k] < tmax) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+// intersect one ray with planes p .. p+SIMD_WIDTH-1, same conventions as
+// sphere_hit_packet()
+static inline int plane_hit_packet(int p, real* Ro, real* Rd, real tmax, real* t) {
+#ifdef __AVX2__
+    vreal nx = V(loadu)(&scene.plane_normal[0][p]);
+    vreal ny = V(loadu)(&scene.plane_normal[1][p]);
+    vreal nz = V(loadu)(&scene.plane_normal[2][p]);
+    vreal sx = V(sub)(V(loadu)(&scene.plane_point[0][p]), V(set1)(Ro[0]));
+    vreal sy = V(sub)(V(loadu)(&scene.plane_point[1][p]), V(set1)(Ro[1]));
+    vreal sz = V(sub)(V(loadu)(&scene.plane_point[2][p]), V(set1)(Ro[2]));
+    vreal dot1 = V(add)(V(add)(V(mul)(nx, sx), V(mul)(ny, sy)), V(mul)(nz, sz));
+    vreal dot2 = V(add)(V(add)(V(mul)(nx, V(set1)(Rd[0])), V(mul)(ny, V(set1)(Rd[1]))),
+                        V(mul)(nz, V(set1)(Rd[2])));
+    vreal result = V(div)(dot1, dot2);
+    V(storeu)(t, result);
+    vreal hit = V(and)(V(cmp)(result, V(setzero)(), _CMP_GT_OQ),
+                       V(cmp)(result, V(set1)(tmax), _CMP_LT_OQ));
+    return V(movemask)(hit);
+#else
+    int mask = 0;
+    for (int k = 0; k < SIMD_WIDTH; k++) {
+        t[k] = plane_hit(p + k, Ro, Rd);
+        if (t[k] > 0 && t[k] < tmax) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+#ifdef __AVX2__
+// the three components of a - b for a register of vectors
+#define VSUB3(r, a, b) \
+    vreal r[3] = {V(sub)(a[0], b[0]), V(sub)(a[1], b[1]), V(sub)(a[2], b[2])}
+#define VDOT(a, b) V(add)(V(add)(V(mul)(a[0], b[0]), V(mul)(a[1], b[1])), V(mul)(a[2], b[2]))
+#define VCROSS(r, a, b) vreal r[3] = { \
+    V(sub)(V(mul)(a[1], b[2]), V(mul)(a[2], b[1])), \
+    V(sub)(V(mul)(a[2], b[0]), V(mul)(a[0], b[2])), \
+    V(sub)(V(mul)(a[0], b[1]), V(mul)(a[1], b[0]))}
+#endif
+
+// intersect one ray with triangles t .. t+SIMD_WIDTH-1, same conventions as
+// sphere_hit_packet() and bit identical to triangle_hit(). the corners are
+// gathered through the index buffer into lanes first
+static inline int triangle_hit_packet(int t, real* Ro, real* Rd, real tmax, real* dist) {
+#ifdef __AVX2__
+    real corner[3][3][SIMD_WIDTH];
+    for (int k = 0; k < SIMD_WIDTH; k++) {
+        int* index = &scene.triangle_vertex[3*(size_t)(t + k)];
+        for (int c = 0; c < 3; c++) {
+            real* vertex = &scene.mesh_vertex[3*(size_t)index[c]];
+            corner[c][0][k] = vertex[0];
+            corner[c][1][k] = vertex[1];
+            corner[c][2][k] = vertex[2];
+        }
+    }
+    vreal a[3];
+    vreal b[3];
+    vreal c[3];
+    vreal o[3];
+    vreal d[3];
+    for (int k = 0; k < 3; k++) {
+        a[k] = V(loadu)(corner[0][k]);
+        b[k] = V(loadu)(corner[1][k]);
+        c[k] = V(loadu)(corner[2][k]);
+        o[k] = V(set1)(Ro[k]);
+        d[k] = V(set1)(Rd[k]);
+    }
+    VSUB3(e1, b, a);
+    VSUB3(e2, c, a);
+    VSUB3(s, o, a);
+    VCROSS(p, d, e2);
+    VCROSS(q, s, e1);
+    vreal inv = V(div)(V(set1)(1), VDOT(e1, p));
+    vreal u = V(mul)(VDOT(s, p), inv);
+    vreal v = V(mul)(VDOT(d, q), inv);
+    vreal result = V(mul)(VDOT(e2, q), inv);
+    vreal zero = V(setzero)();
+    vreal hit = V(and)(V(cmp)(u, zero, _CMP_GE_OQ), V(cmp)(v, zero, _CMP_GE_OQ));
+    hit = V(and)(hit, V(cmp)(V(add)(u, v), V(set1)(1), _CMP_LE_OQ));
+    hit = V(and)(hit, V(cmp)(result, zero, _CMP_GT_OQ));
+    result = V(blendv)(V(set1)(-1), result, hit);
+    V(storeu)(dist, result);
+    hit = V(and)(hit, V(cmp)(result, V(set1)(tmax), _CMP_LT_OQ));
+    return V(movemask)(hit);
+#else
+    int mask = 0;
+    for (int k = 0; k < SIMD_WIDTH; k++) {
+        dist[k] = triangle_hit(t + k, Ro, Rd);
+        if (dist[k] > 0 && dist[k] < tmax) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+// lanes of a group of SIMD_WIDTH starting at first that fall before end
+static inline int lane_mask(int first, int end) {
+    int n = end - first;
+    return n >= SIMD_WIDTH ? (1 << SIMD_WIDTH) - 1 : (1 << n) - 1;
+}
+
+// a leaf is tested as one packet, so it holds at most a packet of spheres
+#define BVH_LEAF_SIZE SIMD_WIDTH
+// past this depth splits are forced even so the tree stays within the stack
+#define BVH_MAX_DEPTH 48
+#define BVH_STACK_SIZE 96
+
+// spheres live in the bvh, infinite planes can't be bounded so they are
+// always tested
+BVHNode* bvh_nodes = NULL;
+int bvh_node_count = 0;
+
+// grow a box so it covers a sphere, padded slightly since the radius is
+// recovered from its square
+void bvh_grow(BVHNode* node, int s) {
+    real r = sqrt(scene.sphere_r2[s]) * (1 + BOX_PAD);
+    for (int k = 0; k < 3; k++) {
+        real p = scene.sphere_center[k][s];
+        if (p - r < node->min[k]) node->min[k] = p - r;
+        if (p + r > node->max[k]) node->max[k] = p + r;
+    }
+}
+
+// recursively split order[first .. first+count) at the middle of the
+// widest axis of their centers, falling back to an even split
+void bvh_split(int* order, int index, int first, int count, int depth) {
+    BVHNode* node = &bvh_nodes[index];
+    real cmin[3] = {INFINITY, INFINITY, INFINITY};
+    real cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int k = 0; k < 3; k++) {
+        node->min[k] = INFINITY;
+        node->max[k] = -INFINITY;
+    }
+    for (int s = first; s < first + count; s++) {
+        bvh_grow(node, order[s]);
+        for (int k = 0; k < 3; k++) {
+            real p = scene.sphere_center[k][order[s]];
+            if (p < cmin[k]) cmin[k] = p;
+            if (p > cmax[k]) cmax[k] = p;
+        }
+    }
+    node->first = first;
+    node->count = count;
+    if (count <= BVH_LEAF_SIZE) {
+        return;
+    }
+
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) axis = k;
+    }
+    real mid = (cmin[axis] + cmax[axis]) / 2;
+    int i = first;
+    int j = first + count - 1;
+    while (i <= j) {
+        if (scene.sphere_center[axis][order[i]] < mid) {
+            i++;
+        } else {
+            int tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+            j--;
+        }
+    }
+    int left = i - first;
+    if (left == 0 || left == count || depth >= BVH_MAX_DEPTH) {
+        left = count / 2;
+    }
+
+    int child = bvh_node_count;
+    bvh_node_count += 2;
+    node->first = child;
+    node->count = 0;
+    bvh_split(order, child, first, left, depth + 1);
+    bvh_split(order, child + 1, first + left, count - left, depth + 1);
+}
+
+// put a primitive array into bvh leaf order, going through a scratch copy
+void bvh_permute(void* field, size_t size, int* order, int count) {
+    char* scratch = arena_alloc(&parse_arena, size*count);
+    memcpy(scratch, field, size*count);
+    for (int s = 0; s < count; s++) {
+        memcpy((char*)field + size*s, scratch + size*order[s], size);
+    }
+}
+
+// build the hierarchy over every sphere, then reorder the sphere arrays so
+// each leaf covers a contiguous run of them. scratch comes from the parse
+// arena, so this must run before it is released
+void build_bvh() {
+    int spheres = scene.sphere_count;
+    bvh_node_count = 0;
+    if (spheres == 0) {
+        return;
+    }
+    // a binary tree with leaves of at least one sphere has under 2n nodes;
+    // it is built in scratch and only the nodes used are kept
+    bvh_nodes = arena_alloc(&parse_arena, sizeof(BVHNode)*(2*(size_t)spheres + 1));
+
+    int* order = arena_alloc(&parse_arena, sizeof(int)*spheres);
+    for (int s = 0; s < spheres; s++) {
+        order[s] = s;
+    }
+    bvh_node_count = 1;
+    bvh_split(order, 0, 0, spheres, 0);
+    BVHNode* nodes = arena_alloc(&scene_arena, sizeof(BVHNode)*bvh_node_count);
+    memcpy(nodes, bvh_nodes, sizeof(BVHNode)*bvh_node_count);
+    bvh_nodes = nodes;
+
+    for (int k = 0; k < 3; k++) {
+        bvh_permute(scene.sphere_center[k], sizeof(real), order, spheres);
+    }
+    bvh_permute(scene.sphere_r2, sizeof(real), order, spheres);
+    bvh_permute(scene.sphere_material, sizeof(int), order, spheres);
+    scene.sphere_slot = arena_alloc(&scene_arena, sizeof(int)*(spheres + SIMD_WIDTH));
+    for (int s = 0; s < spheres; s++) {
+        scene.sphere_slot[order[s]] = s;
+    }
+}
+
+// a leaf of the triangle bvh is tested as one packet too
+#define TRIANGLE_LEAF_SIZE SIMD_WIDTH
+// split planes tried per node, evenly spaced over the node's centers
+#define TRIANGLE_BINS 16
+
+// grow a box so it covers box b of the boxes list, 6 reals each
+static inline void box_grow(real* min, real* max, real* boxes, int b) {
+    real* box = &boxes[6*(size_t)b];
+    for (int k = 0; k < 3; k++) {
+        if (box[k] < min[k]) min[k] = box[k];
+        if (box[3 + k] > max[k]) max[k] = box[3 + k];
+    }
+}
+
+// half the surface area of a box, which is what a ray's odds of hitting it
+// go by
+static inline real box_area(real* min, real* max) {
+    real d[3] = {max[0] - min[0], max[1] - min[1], max[2] - min[2]};
+    return d[0]*d[1] + d[1]*d[2] + d[2]*d[0];
+}
+
+// center of box b along axis k
+static inline real box_center(real* boxes, int b, int k) {
+    return (boxes[6*(size_t)b + k] + boxes[6*(size_t)b + 3 + k]) / 2;
+}
+
+static inline int triangle_bin(real center, real low, real scale) {
+    int bin = (int)((center - low) * scale);
+    return bin < 0 ? 0 : bin >= TRIANGLE_BINS ? TRIANGLE_BINS - 1 : bin;
+}
+
+// recursively split order[first .. first+count) of the triangles. meshes
+// are dense and uneven, so unlike the sphere tree each split is the one of
+// TRIANGLE_BINS planes across the widest axis of the centers that the
+// surface area heuristic rates cheapest, falling back to an even split
+void triangle_split(int* order, real* boxes, int index, int first, int count, int depth) {
+    BVHNode* node = &scene.triangle_nodes[index];
+    real cmin[3] = {INFINITY, INFINITY, INFINITY};
+    real cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int k = 0; k < 3; k++) {
+        node->min[k] = INFINITY;
+        node->max[k] = -INFINITY;
+    }
+    for (int i = first; i < first + count; i++) {
+        box_grow(node->min, node->max, boxes, order[i]);
+        for (int k = 0; k < 3; k++) {
+            real p = box_center(boxes, order[i], k);
+            if (p < cmin[k]) cmin[k] = p;
+            if (p > cmax[k]) cmax[k] = p;
+        }
+    }
+    // the slab test rounds, so boxes get the same slack as the sphere tree's
+    for (int k = 0; k < 3; k++) {
+        node->min[k] -= BOX_PAD * (1 + fabs(node->min[k]));
+        node->max[k] += BOX_PAD * (1 + fabs(node->max[k]));
+    }
+    node->first = first;
+    node->count = count;
+    if (count <= TRIANGLE_LEAF_SIZE) {
+        return;
+    }
+
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) axis = k;
+    }
+    int left = 0;
+    real extent = cmax[axis] - cmin[axis];
+    if (extent > 0 && depth < BVH_MAX_DEPTH) {
+        real scale = TRIANGLE_BINS / extent;
+        int bin_count[TRIANGLE_BINS] = {0};
+        real bin_min[TRIANGLE_BINS][3];
+        real bin_max[TRIANGLE_BINS][3];
+        for (int b = 0; b < TRIANGLE_BINS; b++) {
+            for (int k = 0; k < 3; k++) {
+                bin_min[b][k] = INFINITY;
+                bin_max[b][k] = -INFINITY;
+            }
+        }
+        for (int i = first; i < first + count; i++) {
+            int b = triangle_bin(box_center(boxes, order[i], axis), cmin[axis], scale);
+            bin_count[b]++;
+            box_grow(bin_min[b], bin_max[b], boxes, order[i]);
+        }
+
+        // sweep in from the right for the cost of everything past each
+        // plane, then in from the left to find the cheapest plane
+        real right_cost[TRIANGLE_BINS];
+        real min[3] = {INFINITY, INFINITY, INFINITY};
+        real max[3] = {-INFINITY, -INFINITY, -INFINITY};
+        int n = 0;
+        for (int b = TRIANGLE_BINS - 1; b > 0; b--) {
+            n += bin_count[b];
+            for (int k = 0; k < 3; k++) {
+                min[k] = fmin(min[k], bin_min[b][k]);
+                max[k] = fmax(max[k], bin_max[b][k]);
+            }
+            right_cost[b] = n > 0 ? box_area(min, max) * n : 0;
+        }
+        for (int k = 0; k < 3; k++) {
+            min[k] = INFINITY;
+            max[k] = -INFINITY;
+        }
+        n = 0;
+        int split = -1;
+        real best = INFINITY;
+        for (int b = 0; b < TRIANGLE_BINS - 1; b++) {
+            n += bin_count[b];
+            for (int k = 0; k < 3; k++) {
+                min[k] = fmin(min[k], bin_min[b][k]);
+                max[k] = fmax(max[k], bin_max[b][k]);
+            }
+            if (n == 0 || n == count) {
+                continue;
+            }
+            real cost = box_area(min, max) * n + right_cost[b + 1];
+            if (cost < best) {
+                best = cost;
+                split = b;
+            }
+        }
+
+        int i = first;
+        int j = first + count - 1;
+        while (split >= 0 && i <= j) {
+            if (triangle_bin(box_center(boxes, order[i], axis), cmin[axis], scale) <= split) {
+                i++;
+            } else {
+                int tmp = order[i];
+                order[i] = order[j];
+                order[j] = tmp;
+                j--;
+            }
+        }
+        left = split >= 0 ? i - first : 0;
+    }
+    if (left == 0 || left == count) {
+        left = count / 2;
+    }
+
+    int child = scene.triangle_node_count;
+    scene.triangle_node_count += 2;
+    node->first = child;
+    node->count = 0;
+    triangle_split(order, boxes, child, first, left, depth + 1);
+    triangle_split(order, boxes, child + 1, first + left, count - left, depth + 1);
+}
+
+// build the hierarchy over every triangle and reorder the index and material
+// buffers into its leaf order; the vertices stay where they are. scratch
+// comes from the parse arena, as for build_bvh()
+void build_triangle_bvh() {
+    int triangles = scene.triangle_count;
+    scene.triangle_node_count = 0;
+    if (triangles == 0) {
+        return;
+    }
+    scene.triangle_nodes = arena_alloc(&parse_arena, sizeof(BVHNode)*(2*(size_t)triangles + 1));
+    // each triangle's box is worked out once, so the splits never go
+    // through the index buffer
+    real* boxes = arena_alloc(&parse_arena, sizeof(real)*6*(size_t)triangles);
+    int* order = arena_alloc(&parse_arena, sizeof(int)*triangles);
+    for (int t = 0; t < triangles; t++) {
+        real* box = &boxes[6*(size_t)t];
+        for (int k = 0; k < 3; k++) {
+            box[k] = INFINITY;
+            box[3 + k] = -INFINITY;
+        }
+        for (int c = 0; c < 3; c++) {
+            real* vertex = &scene.mesh_vertex[3*(size_t)scene.triangle_vertex[3*(size_t)t + c]];
+            for (int k = 0; k < 3; k++) {
+                box[k] = fmin(box[k], vertex[k]);
+                box[3 + k] = fmax(box[3 + k], vertex[k]);
+            }
+        }
+        order[t] = t;
+    }
+    scene.triangle_node_count = 1;
+    triangle_split(order, boxes, 0, 0, triangles, 0);
+    BVHNode* nodes = arena_alloc(&scene_arena, sizeof(BVHNode)*scene.triangle_node_count);
+    memcpy(nodes, scene.triangle_nodes, sizeof(BVHNode)*scene.triangle_node_count);
+    scene.triangle_nodes = nodes;
+
+    bvh_permute(scene.triangle_vertex, 3*sizeof(int), order, triangles);
+    bvh_permute(scene.triangle_material, sizeof(int), order, triangles);
+}
+
+// parent of every node and the leaf holding every sphere, only built once
+// spheres start moving
+int* bvh_parent = NULL;
+int* bvh_leaf = NULL;
+
+void bvh_refit_init() {
+    if (bvh_parent != NULL || bvh_node_count == 0) {
+        return;
+    }
+    bvh_parent = arena_alloc(&scene_arena, sizeof(int)*bvh_node_count);
+    bvh_leaf = arena_alloc(&scene_arena, sizeof(int)*scene.sphere_count);
+    bvh_parent[0] = -1;
+    for (int i = 0; i < bvh_node_count; i++) {
+        BVHNode* node = &bvh_nodes[i];
+        if (node->count == 0) {
+            bvh_parent[node->first] = i;
+            bvh_parent[node->first + 1] = i;
+        } else {
+            for (int s = node->first; s < node->first + node->count; s++) {
+                bvh_leaf[s] = i;
+            }
+        }
+    }
+}
+
+// recompute the boxes above a sphere that moved or changed size, stopping
+// as soon as a box comes out the same. the tree keeps its shape, so it
+// loosens if spheres travel far from where it was built
+void bvh_refit(int s) {
+    bvh_refit_init();
+    int index = bvh_leaf[s];
+    while (index >= 0) {
+        BVHNode* node = &bvh_nodes[index];
+        BVHNode box;
+        for (int k = 0; k < 3; k++) {
+            box.min[k] = INFINITY;
+            box.max[k] = -INFINITY;
+        }
+        if (node->count == 0) {
+            for (int c = node->first; c <= node->first + 1; c++) {
+                for (int k = 0; k < 3; k++) {
+                    box.min[k] = fmin(box.min[k], bvh_nodes[c].min[k]);
+                    box.max[k] = fmax(box.max[k], bvh_nodes[c].max[k]);
+                }
+            }
+        } else {
+            for (int i = node->first; i < node->first + node->count; i++) {
+                bvh_grow(&box, i);
+            }
+        }
+        if (memcmp(box.min, node->min, sizeof(box.min)) == 0 &&
+            memcmp(box.max, node->max, sizeof(box.max)) == 0) {
+            return;
+        }
+        memcpy(node->min, box.min, sizeof(box.min));
+        memcpy(node->max, box.max, sizeof(box.max));
+        index = bvh_parent[index];
+    }
+}
+
+// slab test, returns the distance the ray enters the box or INFINITY on a miss
+static inline real bvh_box(BVHNode* node, real* Ro, real* inv, real tmax) {
+    real tmin = 0;
+    for (int k = 0; k < 3; k++) {
+        real t0 = (node->min[k] - Ro[k]) * inv[k];
+        real t1 = (node->max[k] - Ro[k]) * inv[k];
+        if (t0 > t1) {
+            real tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        // written so a NaN from 0 * inf never shrinks the interval
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+    }
+    return tmin <= tmax ? tmin : INFINITY;
+}
+
+// nearest plane a ray hits, -1 for none, with its distance in *best_t
+// (INFINITY for none)
+int closest_plane(Stats* stats, real* Ro, real* Rd, real* best_t) {
+    int best = -1;
+    real t[SIMD_WIDTH];
+    *best_t = INFINITY;
+    STAT_ADD(stats, plane_tests, scene.plane_count);
+    for (int p = 0; p < scene.plane_count; p += SIMD_WIDTH) {
+        int mask = plane_hit_packet(p, Ro, Rd, *best_t, t) & lane_mask(p, scene.plane_count);
+        for (int k = 0; mask != 0; k++, mask >>= 1) {
+            if ((mask & 1) && t[k] < *best_t) {
+                *best_t = t[k];
+                best = scene.sphere_count + p + k;
+            }
+        }
+    }
+    return best;
+}
+
+// nearest triangle closer than *best_t, walking the triangle bvh nearer
+// child first; returns its object id, or best if there is none. ties go to
+// the lowest id as for spheres
+int closest_triangle(Stats* stats, real* Ro, real* Rd, real* best_t, int best) {
+    if (scene.triangle_node_count == 0) {
+        return best;
+    }
+    BVHNode* nodes = scene.triangle_nodes;
+    int base = scene.sphere_count + scene.plane_count;
+    real t[SIMD_WIDTH];
+    real inv[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        BVHNode* node = &nodes[stack[--top]];
+        STAT_ADD(stats, box_tests, 1);
+        if (bvh_box(node, Ro, inv, *best_t) == INFINITY) {
+            continue;
+        }
+        if (node->count > 0) {
+            STAT_ADD(stats, triangle_tests, node->count);
+            int mask = triangle_hit_packet(node->first, Ro, Rd, nextafter(*best_t, INFINITY), t);
+            mask &= lane_mask(0, node->count);
+            for (int k = 0; mask != 0; k++, mask >>= 1) {
+                int id = base + node->first + k;
+                if ((mask & 1) && (t[k] < *best_t || (t[k] == *best_t && id < best))) {
+                    *best_t = t[k];
+                    best = id;
+                }
+            }
+        } else {
+            int near = node->first;
+            int far = node->first + 1;
+            real tn = bvh_box(&nodes[near], Ro, inv, *best_t);
+            real tf = bvh_box(&nodes[far], Ro, inv, *best_t);
+            STAT_ADD(stats, box_tests, 2);
+            if (tf < tn) {
+                int tmp = near;
+                near = far;
+                far = tmp;
+                real t = tn;
+                tn = tf;
+                tf = t;
+            }
+            if (tf != INFINITY) stack[top++] = far;
+            if (tn != INFINITY) stack[top++] = near;
+        }
+    }
+    return best;
+}
+
+// the triangle part of occluded(), which has already tried the cached
+// occluder
+int occluding_triangle(Stats* stats, real* Ro, real* Rd, real dist, int skip, int* cache) {
+    int last = *cache;
+    if (scene.triangle_node_count == 0) {
+        return -1;
+    }
+    BVHNode* nodes = scene.triangle_nodes;
+    int base = scene.sphere_count + scene.plane_count;
+    real t[SIMD_WIDTH];
+    real inv[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        BVHNode* node = &nodes[stack[--top]];
+        STAT_ADD(stats, box_tests, 1);
+        if (bvh_box(node, Ro, inv, dist) == INFINITY) {
+            continue;
+        }
+        if (node->count > 0) {
+            STAT_ADD(stats, triangle_tests, node->count);
+            int mask = triangle_hit_packet(node->first, Ro, Rd, dist, t) & lane_mask(0, node->count);
+            for (int k = 0; mask != 0; k++, mask >>= 1) {
+                int id = base + node->first + k;
+                if ((mask & 1) && id != skip && id != last) {
+                    *cache = id;
+                    return id;
+                }
+            }
+        } else {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+    return -1;
+}
+
+// closest object hit by the ray, returns its object id or -1
+int closest_hit(Stats* stats, real* Ro, real* Rd, real* best_t) {
+    real t[SIMD_WIDTH];
+    int best = closest_plane(stats, Ro, Rd, best_t);
+    if (bvh_node_count == 0) {
+        return closest_triangle(stats, Ro, Rd, best_t, best);
+    }
+
+    real inv[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        BVHNode* node = &bvh_nodes[stack[--top]];
+        STAT_ADD(stats, box_tests, 1);
+        if (bvh_box(node, Ro, inv, *best_t) == INFINITY) {
+            continue;
+        }
+        if (node->count > 0) {
+            STAT_ADD(stats, sphere_tests, node->count);
+            // leaves hold at most SIMD_WIDTH spheres, so one packet covers them;
+            // the mask admits ties so the lowest id can win them below
+            int mask = sphere_hit_packet(node->first, Ro, Rd, nextafter(*best_t, INFINITY), t);
+            mask &= lane_mask(0, node->count);
+            for (int k = 0; mask != 0; k++, mask >>= 1) {
+                int s = node->first + k;
+                // equal distances go to the lowest id so traversal order never matters
+                if ((mask & 1) && (t[k] < *best_t || (t[k] == *best_t && s < best))) {
+                    *best_t = t[k];
+                    best = s;
+                }
+            }
+        } else {
+            // visit the nearer child first so best_t shrinks early
+            int near = node->first;
+            int far = node->first + 1;
+            real tn = bvh_box(&bvh_nodes[near], Ro, inv, *best_t);
+            real tf = bvh_box(&bvh_nodes[far], Ro, inv, *best_t);
+            STAT_ADD(stats, box_tests, 2);
+            if (tf < tn) {
+                int tmp = near;
+                near = far;
+                far = tmp;
+                real t = tn;
+                tn = tf;
+                tf = t;
+            }
+            if (tf != INFINITY) stack[top++] = far;
+            if (tn != INFINITY) stack[top++] = near;
+        }
+    }
+    return closest_triangle(stats, Ro, Rd, best_t, best);
+}
+
+// any-hit occlusion query, Rd must be normalized so t is a distance; returns
+// the first object other than skip hit with 0 < t < dist, or -1 if the path
+// is clear. *cache holds the last occluder found for this light and is tried
+// before anything else, since neighbouring pixels are usually blocked by the
+// same object
+int occluded(Stats* stats, real* Ro, real* Rd, real dist, int skip, int* cache) {
+    int last = *cache;
+    if (last >= 0 && last != skip) {
+        real t = object_intersection(last, Ro, Rd);
+        if (last < scene.sphere_count) {
+            STAT_ADD(stats, sphere_tests, 1);
+        } else if (last < scene.sphere_count + scene.plane_count) {
+            STAT_ADD(stats, plane_tests, 1);
+        } else {
+            STAT_ADD(stats, triangle_tests, 1);
+        }
+        if (t > 0 && t < dist) {
+            STAT_ADD(stats, occluder_cache_hits, 1);
+            return last;
+        }
+    }
+
+    real t[SIMD_WIDTH];
+    for (int p = 0; p < scene.plane_count; p += SIMD_WIDTH) {
+        int mask = plane_hit_packet(p, Ro, Rd, dist, t) & lane_mask(p, scene.plane_count);
+        STAT_ADD(stats, plane_tests, scene.plane_count - p < SIMD_WIDTH ? scene.plane_count - p : SIMD_WIDTH);
+        for (int k = 0; mask != 0; k++, mask >>= 1) {
+            int id = scene.sphere_count + p + k;
+            if ((mask & 1) && id != skip && id != last) {
+                *cache = id;
+                return id;
+            }
+        }
+    }
+    if (bvh_node_count == 0) {
+        return occluding_triangle(stats, Ro, Rd, dist, skip, cache);
+    }
+
+    real inv[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        BVHNode* node = &bvh_nodes[stack[--top]];
+        STAT_ADD(stats, box_tests, 1);
+        if (bvh_box(node, Ro, inv, dist) == INFINITY) {
+            continue;
+        }
+        if (node->count > 0) {
+            STAT_ADD(stats, sphere_tests, node->count);
+            int mask = sphere_hit_packet(node->first, Ro, Rd, dist, t) & lane_mask(0, node->count);
+            for (int k = 0; mask != 0; k++, mask >>= 1) {
+                int s = node->first + k;
+                if ((mask & 1) && s != skip && s != last) {
+                    *cache = s;
+                    return s;
+                }
+            }
+        } else {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+    return occluding_triangle(stats, Ro, Rd, dist, skip, cache);
+}
+
+// lights whose contribution anywhere falls under this fraction of full
+// brightness are left out; 0 keeps every light that can add anything
+#define LIGHT_CUTOFF (1.0 / 1024)
+// cells in the light grid per light, and the most one light may cover
+// before it is treated as reaching everywhere
+#define LIGHT_GRID_DENSITY 4
+#define LIGHT_GRID_MAX_CELLS (1 << 21)
+#define LIGHT_MAX_CELLS 4096
+
+// which lights can reach a point. each light gets an influence radius past
+// which its radial falloff keeps it under the cutoff for every material;
+// bounded lights are binned in a uniform grid over their spheres, the rest
+// are considered everywhere. lists hold light indexes in ascending order so
+// lights are always added up in scene order
+typedef struct {
+    double* radius;  // influence radius, INFINITY when it can't be bounded
+    double* bound;   // the most a light can add to a channel before falloff
+    int* global;     // lights with no radius, considered at every point
+    int global_count;
+    int culled;      // lights that can never add anything
+    int res[3];      // grid cells per axis, 0 when there is no grid
+    double min[3];
+    double cell;
+    size_t* cell_start;
+    int* cell_lights;
+} LightIndex;
+
+// influence radius of one light, and in *bound the most it can add to a
+// channel at zero distance
+double light_radius(Light* l, double cutoff, double material, double* bound) {
+    real* a = l->radial;
+    double intensity = fmax(fmax(l->color[0], l->color[1]), l->color[2]) * material;
+    // the cone factor pow(cos, angular) is at most 1 unless angular is negative
+    if ((l->kind & LIGHT_SPOT) && l->angular < 0) {
+        *bound = INFINITY;
+        return INFINITY;
+    }
+    *bound = intensity;
+    // fradial gives exactly 0 when every coefficient is 0
+    if (intensity <= 0 || (a[0] == 0 && a[1] == 0 && a[2] == 0)) {
+        return 0;
+    }
+    if (cutoff <= 0 || a[0] < 0 || a[1] < 0 || a[2] < 0) {
+        return INFINITY;
+    }
+    // past the radius a2 d^2 + a1 d + a0 > intensity / cutoff
+    double c = a[0] - intensity / cutoff;
+    if (c >= 0) {
+        return 0;
+    }
+    if (a[2] == 0) {
+        return a[1] == 0 ? INFINITY : -c / a[1];
+    }
+    return (-a[1] + sqrt(a[1]*a[1] - 4*a[2]*c)) / (2*a[2]);
+}
+
+int compare_int(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// cells of the grid a light's sphere overlaps
+static inline void light_cells(LightIndex* li, Light* l, double radius, int* lo, int* hi) {
+    for (int k = 0; k < 3; k++) {
+        lo[k] = (int)floor((l->position[k] - radius - li->min[k]) / li->cell);
+        hi[k] = (int)floor((l->position[k] + radius - li->min[k]) / li->cell);
+        if (lo[k] < 0) lo[k] = 0;
+        if (hi[k] >= li->res[k]) hi[k] = li->res[k] - 1;
+    }
+}
+
+// the step between the two passes of a counting sort into cells, shared
+// by the light grid and the screen bins. after counting (pass 0) the counts
+// in start[1 .. cells] become where each cell's entries start, and the
+// list to fill is returned; after filling, which moved every start to the
+// next cell's, they are moved back and NULL is returned
+int* cells_pass_done(size_t* start, size_t cells, int pass) {
+    if (pass == 0) {
+        for (size_t c = 0; c < cells; c++) {
+            start[c + 1] += start[c];
+        }
+        return malloc(sizeof(int)*(start[cells] + 1));
+    }
+    for (size_t c = cells; c > 0; c--) {
+        start[c] = start[c - 1];
+    }
+    start[0] = 0;
+    return NULL;
+}
+
+void light_index_build(LightIndex* li, double cutoff) {
+    int n = scene.light_count;
+    memset(li, 0, sizeof(LightIndex));
+    li->radius = malloc(sizeof(double)*(n + 1));
+    li->bound = malloc(sizeof(double)*(n + 1));
+    li->global = malloc(sizeof(int)*(n + 1));
+
+    // no material reflects more of a channel than this
+    double material = 0;
+    for (int m = 0; m < scene.material_count; m++) {
+        for (int c = 0; c < 3; c++) {
+            material = fmax(material, scene.materials[m].diffuse[c] + scene.materials[m].specular[c]);
+        }
+    }
+    double lo[3] = {INFINITY, INFINITY, INFINITY};
+    double hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    int bounded = 0;
+    for (int i = 0; i < n; i++) {
+        Light* l = &scene.lights[i];
+        li->radius[i] = light_radius(l, cutoff, material, &li->bound[i]);
+        if (li->radius[i] == 0) {
+            li->culled++;
+        } else if (li->radius[i] == INFINITY) {
+            li->global[li->global_count++] = i;
+        } else {
+            for (int k = 0; k < 3; k++) {
+                lo[k] = fmin(lo[k], l->position[k] - li->radius[i]);
+                hi[k] = fmax(hi[k], l->position[k] + li->radius[i]);
+            }
+            bounded++;
+        }
+    }
+    if (bounded == 0) {
+        return;
+    }
+
+    // cube cells, about LIGHT_GRID_DENSITY per bounded light
+    double extent = fmax(fmax(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+    double volume = fmax(hi[0] - lo[0], extent * 1e-3) *
+                    fmax(hi[1] - lo[1], extent * 1e-3) *
+                    fmax(hi[2] - lo[2], extent * 1e-3);
+    double target = fmin((double)bounded * LIGHT_GRID_DENSITY, LIGHT_GRID_MAX_CELLS);
+    li->cell = fmax(cbrt(volume / target), extent / 256);
+    size_t cells = 1;
+    for (int k = 0; k < 3; k++) {
+        li->min[k] = lo[k];
+        li->res[k] = (int)ceil((hi[k] - lo[k]) / li->cell);
+        if (li->res[k] < 1) li->res[k] = 1;
+        if (li->res[k] > 256) li->res[k] = 256;
+        cells *= li->res[k];
+    }
+    li->cell_start = calloc(cells + 1, sizeof(size_t));
+
+    // count, then fill; lights that would cover too many cells go global
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < n; i++) {
+            double radius = li->radius[i];
+            if (radius == 0 || radius == INFINITY) {
+                continue;
+            }
+            int a[3], b[3];
+            light_cells(li, &scene.lights[i], radius, a, b);
+            size_t covered = (size_t)(b[0] - a[0] + 1) * (b[1] - a[1] + 1) * (b[2] - a[2] + 1);
+            if (covered > LIGHT_MAX_CELLS && covered > cells / 4) {
+                if (pass == 0) {
+                    li->radius[i] = INFINITY;
+                    li->global[li->global_count++] = i;
+                }
+                continue;
+            }
+            for (int z = a[2]; z <= b[2]; z++) {
+                for (int y = a[1]; y <= b[1]; y++) {
+                    for (int x = a[0]; x <= b[0]; x++) {
+                        size_t c = ((size_t)z * li->res[1] + y) * li->res[0] + x;
+                        if (pass == 0) {
+                            li->cell_start[c + 1]++;
+                        } else {
+                            li->cell_lights[li->cell_start[c]++] = i;
+                        }
+                    }
+                }
+            }
+        }
+        int* list = cells_pass_done(li->cell_start, cells, pass);
+        if (pass == 0) {
+            li->cell_lights = list;
+        }
+    }
+    // lights moved to the global list during counting went in out of order
+    qsort(li->global, li->global_count, sizeof(int), compare_int);
+}
+
+void light_index_free(LightIndex* li) {
+    free(li->radius);
+    free(li->bound);
+    free(li->global);
+    free(li->cell_start);
+    free(li->cell_lights);
+}
+
+// lights of the grid cell holding a point, none outside the grid
+static inline int light_cell(LightIndex* li, real* p, int** lights) {
+    if (li->res[0] == 0) {
+        return 0;
+    }
+    int at[3];
+    for (int k = 0; k < 3; k++) {
+        double f = (p[k] - li->min[k]) / li->cell;
+        if (!(f >= 0 && f < li->res[k])) {
+            return 0;
+        }
+        at[k] = (int)f;
+    }
+    size_t c = ((size_t)at[2] * li->res[1] + at[1]) * li->res[0] + at[0];
+    *lights = &li->cell_lights[li->cell_start[c]];
+    return (int)(li->cell_start[c + 1] - li->cell_start[c]);
+}
+
+// header of a render checkpoint, a sidecar file mapped shared that holds
+// the image buffers and a flag per finished tile of each pass, so a killed
+// render picks up where it stopped. everything from source_hash to
+// tile_count is the key; a checkpoint whose key differs is never reused
+#define CHECKPOINT_MAGIC "RTCKPT"
+#define CHECKPOINT_VERSION 2
+
+typedef struct {
+    char magic[8];
+    int version;
+    int real_size;
+    unsigned long long source_hash;
+    unsigned long long mesh_hash;  // of the mesh files, which source_hash doesn't cover
+    int width;
+    int height;
+    int hdr;
+    int aa;
+    double light_cutoff;
+    int light_samples;
+    int tile_count;
+    int first_saved;  // the first pass has been copied for edge detection
+    size_t size;
+} CheckpointHeader;
+
+// g-buffer file for --gbuffer: what every pixel's primary ray hit in the
+// first pass and the color it got, along with the lights it was shaded
+// with. a later render of the same geometry and settings takes the hits
+// from it instead of tracing primary rays and only shades again for the
+// lights that changed
+#define GBUFFER_MAGIC "RTGBUF"
+#define GBUFFER_VERSION 2
+
+typedef struct {
+    char magic[8];
+    int version;
+    int real_size;
+    unsigned long long geometry_hash;  // of the compiled scene without its lights
+    int width;
+    int height;
+    double light_cutoff;
+    int light_samples;
+    int light_count;  // the lights and their reach follow the header
+    size_t size;
+} GBufferHeader;
+
+typedef struct {
+    double color[3];  // first pass color, 0 .. 255
+    double light[3];  // the same without clamping, for float images
+    real lit[3];      // light the hit got directly, before clamping
+    real distance;    // along the primary ray
+    real normal[3];
+    int id;           // object hit, -1 for none
+    int material;     // its material, -1 for none
+} GBufferPixel;
+
+typedef struct {
+    GBufferPixel* pixels;     // this render's first pass, saved when it finishes
+    double* radius;           // reach of each light in this render
+    GBufferHeader* previous;  // mapped g-buffer whose hits are reused, NULL for none
+    Light* previous_lights;
+    double* previous_radius;
+    GBufferPixel* previous_pixels;
+    int* changed;             // lights that differ between the two, by index
+    int changed_count;
+} GBuffer;
+
+// spheres binned by the square cells of the image their outline can cover,
+// for --raster. primary rays all start at the camera, so a primary ray only
+// needs the spheres of its own cell, tested in a flat loop instead of a
+// bvh walk. spheres reaching to or behind the image plane can't be projected
+// and are tested by every primary ray. every list runs nearest sphere first,
+// so the loop stops at the first sphere that can't be closer than the hit
+// it already has
+typedef struct {
+    int cell;        // pixels per side of a cell, 0 when there is no grid
+    int res[2];      // cells across and down
+    size_t* cell_start;
+    int* cell_spheres;
+    int* global;
+    int global_count;
+    real* near;      // lower bound on the distance from the camera to each sphere
+} ScreenBins;
+
+// pixels per side of a cell, doubled until there are at most
+// SCREEN_MAX_CELLS so huge images keep a small grid
+#define SCREEN_CELL 8
+#define SCREEN_MAX_CELLS (1 << 20)
+// spheres covering more cells than this and a quarter of the grid are global
+#define SCREEN_MAX_COVER 4096
+
+// render settings shared by every worker thread
+typedef struct Render {
+    int width;
+    int height;
+    int left;  // crop of the full image held in the buffers, rows from the top
+    int top;
+    int cols;
+    int rows;
+    real cam_width;
+    real cam_height;
+    real pixwidth;
+    real pixheight;
+    Pixel* image;
+    float* hdr;  // unquantized colors for float output, NULL when not needed
+    int timing;  // time trace and shade per pixel, only when stats were asked for
+    int aa;      // edge pixels get aa x aa samples, 1 turns antialiasing off
+    double light_cutoff;  // see LIGHT_CUTOFF
+    int light_samples;    // lights kept per hit by stochastic selection, 0 keeps all
+    LightIndex lights;    // built from the scene for each render
+    int raster;           // primary rays test the spheres binned for their pixel
+    ScreenBins bins;      // built for each render when raster is on
+    int shared_index;     // lights and bins were built by the caller, who frees them
+    int pass;    // 0 traces every pixel once, 1 supersamples the edges
+    Pixel* first_image;  // copy of the first pass that edge detection reads
+    int* first_id;       // object seen through each pixel in the first pass
+    struct Render* inner;  // the crop this render traces a border around, see render_image
+    CheckpointHeader* checkpoint;  // mapped checkpoint holding the buffers, NULL when off
+    unsigned char* tiles_done;     // per pass flags of finished tiles, in the checkpoint
+    GBuffer* gbuffer;     // first pass hits to record and maybe reuse, NULL when off
+    double deadline;      // --time-budget, tiles aren't started after it; 0 for none
+    int* tile_order;      // order tiles are handed out in, NULL for scanline order
+    int stride;           // pass 0 traces only this grid of pixels, 0 for all of them
+    int tiles_skipped;    // tiles of the pass the deadline left out
+    int level;            // time budgeted levels finished, see render_levels
+    int level_tiles;      // tiles of the level after them done by the deadline
+    pthread_mutex_t stats_lock;
+    Stats stats;  // summed from every thread once it finishes
+} Render;
+
+// pick up the camera size from the scene
+void render_camera(Render* r) {
+    r->cam_width = scene.camera_width;
+    r->cam_height = scene.camera_height;
+    r->pixheight = r->cam_height / r->height;
+    r->pixwidth = r->cam_width / r->width;
+}
+
+// fill in a render of the pixels x0 .. x1-1, y0 .. y1-1 of the loaded
+// scene at the given resolution
+void render_init_crop(Render* r, int width, int height, int x0, int y0, int x1, int y1, int hdr) {
+    r->width = width;
+    r->height = height;
+    r->left = x0;
+    r->top = y0;
+    r->cols = x1 - x0;
+    r->rows = y1 - y0;
+    render_camera(r);
+    r->image = malloc(sizeof(Pixel)*(size_t)r->cols*r->rows);
+    r->hdr = NULL;
+    if (hdr) {
+        r->hdr = malloc(sizeof(float)*3*(size_t)r->cols*r->rows);
+    }
+    r->timing = 0;
+    r->aa = 1;
+    r->light_cutoff = LIGHT_CUTOFF;
+    r->light_samples = 0;
+    r->pass = 0;
+    r->first_image = NULL;
+    r->first_id = NULL;
+    r->inner = NULL;
+    r->raster = 0;
+    r->shared_index = 0;
+    r->checkpoint = NULL;
+    r->tiles_done = NULL;
+    r->gbuffer = NULL;
+    r->deadline = 0;
+    r->tile_order = NULL;
+    r->stride = 0;
+    r->tiles_skipped = 0;
+    r->level = 0;
+    r->level_tiles = 0;
+    pthread_mutex_init(&r->stats_lock, NULL);
+    memset(&r->stats, 0, sizeof(Stats));
+}
+
+void render_init(Render* r, int width, int height, int hdr) {
+    render_init_crop(r, width, height, 0, 0, width, height, hdr);
+}
+
+void render_free(Render* r) {
+    free(r->first_image);
+    free(r->first_id);
+    free(r->tile_order);
+    pthread_mutex_destroy(&r->stats_lock);
+    free(r->image);
+    free(r->hdr);
+}
+
+// range of image columns, or of rows counted up from the bottom, whose
+// pixels a sphere's outline can reach along one axis, given by its center
+// c and depth z and the pixel grid's origin and size on the image plane
+static inline void screen_span(double c, double z, double radius, double origin, double size,
+                               int limit, int* lo, int* hi) {
+    // slopes of the two planes through the camera tangent to the sphere
+    double root = radius * sqrt(c*c + z*z - radius*radius);
+    double a = z*z - radius*radius;
+    double m0 = (c*z - root) / a;
+    double m1 = (c*z + root) / a;
+    // a pixel of margin on each side covers any rounding in the ray setup
+    double p0 = fmax((m0 - origin) / size - 1, -1);
+    double p1 = fmin((m1 - origin) / size + 1, limit);
+    *lo = (int)floor(p0);
+    *hi = (int)floor(p1);
+}
+
+typedef struct {
+    double near;
+    int id;
+} SphereDepth;
+
+int compare_depth(const void* a, const void* b) {
+    const SphereDepth* x = a;
+    const SphereDepth* y = b;
+    if (x->near != y->near) return x->near < y->near ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+// bin the scene's spheres by the cells of r's full image they can cover
+void screen_bins_build(ScreenBins* sb, Render* r) {
+    int n = scene.sphere_count;
+    memset(sb, 0, sizeof(ScreenBins));
+    sb->global = malloc(sizeof(int)*(n + 1));
+    sb->near = malloc(sizeof(real)*(n + 1));
+    // spheres are binned nearest first, which leaves every list sorted.
+    // the bound is pulled in a little so rounding in the hit distance can
+    // never put a hit in front of it
+    SphereDepth* order = malloc(sizeof(SphereDepth)*(n + 1));
+    for (int s = 0; s < n; s++) {
+        double center = sqrt(sqr(scene.sphere_center[0][s]) + sqr(scene.sphere_center[1][s]) +
+                             sqr(scene.sphere_center[2][s]));
+        double radius = sqrt(scene.sphere_r2[s]);
+        order[s].near = fmax(center - radius - 1e-5 * (center + radius), 0);
+        order[s].id = s;
+        sb->near[s] = order[s].near;
+    }
+    qsort(order, n, sizeof(SphereDepth), compare_depth);
+    sb->cell = SCREEN_CELL;
+    while ((size_t)((r->width + sb->cell - 1) / sb->cell) * ((r->height + sb->cell - 1) / sb->cell) >
+           SCREEN_MAX_CELLS) {
+        sb->cell *= 2;
+    }
+    sb->res[0] = (r->width + sb->cell - 1) / sb->cell;
+    sb->res[1] = (r->height + sb->cell - 1) / sb->cell;
+    size_t cells = (size_t)sb->res[0] * sb->res[1];
+    sb->cell_start = calloc(cells + 1, sizeof(size_t));
+    // pixel (0, 0) sits at the bottom left corner of the image plane
+    double x_origin = -r->cam_width / 2;
+    double y_origin = -r->cam_height / 2;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < n; i++) {
+            int s = order[i].id;
+            double radius = sqrt(scene.sphere_r2[s]);
+            double z = scene.sphere_center[2][s];
+            if (z + radius <= 0) {
+                // wholly behind the camera
+                continue;
+            }
+            if (z - radius <= 1e-9 * (fabs(z) + radius)) {
+                if (pass == 0) sb->global[sb->global_count++] = s;
+                continue;
+            }
+            int x0, x1, y0, y1;
+            screen_span(scene.sphere_center[0][s], z, radius, x_origin, r->pixwidth, r->width, &x0, &x1);
+            screen_span(scene.sphere_center[1][s], z, radius, y_origin, r->pixheight, r->height, &y0, &y1);
+            // columns run 0 .. width-1 and pixel y height .. 1 down the rows
+            if (x1 < 0 || x0 >= r->width || y1 < 1 || y0 > r->height) {
+                continue;
+            }
+            // rows count down from the top, pixel y is row height - y
+            int col0 = (x0 < 0 ? 0 : x0) / sb->cell;
+            int col1 = (x1 >= r->width ? r->width - 1 : x1) / sb->cell;
+            int row0 = (r->height - y1 < 0 ? 0 : r->height - y1) / sb->cell;
+            int row1 = (r->height - y0 >= r->height ? r->height - 1 : r->height - y0) / sb->cell;
+            size_t covered = (size_t)(col1 - col0 + 1) * (row1 - row0 + 1);
+            if (covered > SCREEN_MAX_COVER && covered > cells / 4) {
+                if (pass == 0) sb->global[sb->global_count++] = s;
+                continue;
+            }
+            for (int row = row0; row <= row1; row++) {
+                for (int col = col0; col <= col1; col++) {
+                    size_t c = (size_t)row * sb->res[0] + col;
+                    if (pass == 0) {
+                        sb->cell_start[c + 1]++;
+                    } else {
+                        sb->cell_spheres[sb->cell_start[c]++] = s;
+                    }
+                }
+            }
+        }
+        int* list = cells_pass_done(sb->cell_start, cells, pass);
+        if (pass == 0) {
+            sb->cell_spheres = list;
+        }
+    }
+    free(order);
+}
+
+void screen_bins_free(ScreenBins* sb) {
+    free(sb->cell_start);
+    free(sb->cell_spheres);
+    free(sb->global);
+    free(sb->near);
+}
+
+// cell of the pixel a primary ray through image point (px, py) belongs to
+static inline int screen_cell(Render* r, double px, double py) {
+    int col = (int)floor(px) / r->bins.cell;
+    int row = (r->height - (int)floor(py)) / r->bins.cell;
+    return row * r->bins.res[0] + col;
+}
+
+// closest_hit() for a primary ray, testing only the spheres binned in its
+// cell. the bins hold every sphere the ray could hit, and ties go to the
+// lowest id as in closest_hit(), so both find the same object. triangles
+// aren't binned and go through their own bvh
+int screen_hit(Stats* stats, ScreenBins* sb, int cell, real* Ro, real* Rd, real* best_t) {
+    int best = closest_plane(stats, Ro, Rd, best_t);
+    int* lists[2] = {&sb->cell_spheres[sb->cell_start[cell]], sb->global};
+    size_t counts[2] = {sb->cell_start[cell + 1] - sb->cell_start[cell], sb->global_count};
+    for (int l = 0; l < 2; l++) {
+        for (size_t i = 0; i < counts[l]; i++) {
+            int s = lists[l][i];
+            // the rest are further away; equal bounds can still tie
+            if (sb->near[s] > *best_t) {
+                break;
+            }
+            STAT_ADD(stats, sphere_tests, 1);
+            real t = sphere_hit(s, Ro, Rd);
+            if (t > 0 && (t < *best_t || (t == *best_t && s < best))) {
+                *best_t = t;
+                best = s;
+            }
+        }
+    }
+    return closest_triangle(stats, Ro, Rd, best_t, best);
+}
+
+// deterministic hash to [0, 1) for sample s of a pixel, so antialiased
+// renders and light picks don't depend on which thread traced what
+static inline double sample_jitter(unsigned int x, unsigned int y, unsigned int s) {
+    unsigned int h = x * 0x8da6b343u ^ y * 0xd8163841u ^ s * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.0 / 16777216.0);
+}
+
+// rays are traced a tile at a time in generations: every ray of a
+// generation is intersected, then every hit is shaded, and reflections and
+// refractions become the next generation. this keeps each stage looping
+// over the same code and data instead of recursing pixel by pixel
+#define TRACE_DEPTH 8
+// rays that would change a sample by less than this are not spawned
+#define MIN_WEIGHT (1.0 / 512)
+// secondary rays start this far off the surface at p so they don't hit it
+// again. float spacing grows with distance from the origin, so in float
+// builds the offset does too
+#ifdef REAL_FLOAT
+#define RAY_OFFSET(p) (1e-4f * (1 + fmax(fmax(fabs((p)[0]), fabs((p)[1])), fabs((p)[2]))))
+#else
+#define RAY_OFFSET(p) 1e-7
+#endif
+// hits are shaded in chunks of about this many shadow rays
+#define SHADOW_BATCH 16384
+
+// a ray in flight; whatever it hits is shaded into color and added to its
+// sample scaled by weight
+typedef struct {
+    real origin[3];
+    real direction[3];
+    real weight;
+    int sample;
+    int depth;
+    int hit;  // object hit, -1 for none
+    real distance;  // to the hit along the ray
+    int cell; // screen bin of a primary ray with --raster, else -1
+    int shadow_first;  // its shadow rays in the tracer's list
+    int shadow_count;
+    real point[3];
+    real normal[3];
+    real color[3];
+} Ray;
+
+typedef struct {
+    Ray* rays;
+    int count;
+    int capacity;
+} RayQueue;
+
+// shadow ray from a hit towards a light that may light it
+typedef struct {
+    real direction[3];
+    real distance;
+    real scale;  // 1, or how much a light picked by --light-samples stands for
+    int light;
+    int ray;
+    int blocked;
+} Shadow;
+
+// per thread tracing state, never shared between workers
+typedef struct {
+    int* occluder;  // last occluder seen for each light, -1 if none
+    RayQueue current;
+    RayQueue reflected;
+    RayQueue refracted;
+    Shadow* shadows;
+    int* shadow_order;  // shadow rays sorted by light
+    int* light_start;   // where each light's shadow rays start in that order
+    int shadow_count;
+    int shadow_capacity;
+    double* sample_color;  // 3 per sample, on a 0 .. 255 scale
+    double* sample_light;  // the same without clamping each hit, for float images
+    int* sample_id;        // object seen by each sample's primary ray
+    int sample_capacity;
+    Stats stats;
+} Tracer;
+
+void tracer_init(Tracer* tr) {
+    tr->occluder = malloc(sizeof(int)*(scene.light_count + 1));
+    for (int i = 0; i < scene.light_count; i++) {
+        tr->occluder[i] = -1;
+    }
+    memset(&tr->current, 0, sizeof(RayQueue));
+    memset(&tr->reflected, 0, sizeof(RayQueue));
+    memset(&tr->refracted, 0, sizeof(RayQueue));
+    tr->shadows = NULL;
+    tr->shadow_order = NULL;
+    tr->light_start = malloc(sizeof(int)*(scene.light_count + 1));
+    tr->shadow_count = 0;
+    tr->shadow_capacity = 0;
+    tr->sample_color = NULL;
+    tr->sample_light = NULL;
+    tr->sample_id = NULL;
+    tr->sample_capacity = 0;
+    memset(&tr->stats, 0, sizeof(Stats));
+}
+
+// fold the thread's counters into the render and free it
+void tracer_free(Render* r, Tracer* tr) {
+    pthread_mutex_lock(&r->stats_lock);
+    stats_merge(&r->stats, &tr->stats);
+    pthread_mutex_unlock(&r->stats_lock);
+    free(tr->occluder);
+    free(tr->current.rays);
+    free(tr->reflected.rays);
+    free(tr->refracted.rays);
+    free(tr->shadows);
+    free(tr->shadow_order);
+    free(tr->light_start);
+    free(tr->sample_color);
+    free(tr->sample_light);
+    free(tr->sample_id);
+}
+
+// append a ray to a queue, growing it as needed
+static inline Ray* queue_push(RayQueue* q) {
+    if (q->count == q->capacity) {
+        q->capacity = q->capacity ? 2 * q->capacity : 256;
+        q->rays = realloc(q->rays, sizeof(Ray)*q->capacity);
+        if (q->rays == NULL) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            exit(1);
+        }
+    }
+    return &q->rays[q->count++];
+}
+
+// make room for a batch of samples, all starting black
+void tracer_samples(Tracer* tr, int count) {
+    if (count > tr->sample_capacity) {
+        tr->sample_capacity = count;
+        tr->sample_color = realloc(tr->sample_color, sizeof(double)*3*count);
+        tr->sample_light = realloc(tr->sample_light, sizeof(double)*3*count);
+        tr->sample_id = realloc(tr->sample_id, sizeof(int)*count);
+        if (tr->sample_color == NULL || tr->sample_light == NULL || tr->sample_id == NULL) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            exit(1);
+        }
+    }
+    memset(tr->sample_color, 0, sizeof(double)*3*count);
+    memset(tr->sample_light, 0, sizeof(double)*3*count);
+}
+
+// queue the primary ray for a sample. px and py are positions on the
+// pixel grid, with y counting up from the bottom
+void push_primary(Render* r, Tracer* tr, double px, double py, int sample) {
+    real cx = 0;
+    real cy = 0;
+    real w = r->cam_width;
+    real h = r->cam_height;
+    Ray* ray = queue_push(&tr->current);
+    ray->origin[0] = 0;
+    ray->origin[1] = 0;
+    ray->origin[2] = 0;
+    ray->direction[0] = cx - (w/2) + r->pixwidth * px;
+    ray->direction[1] = cy - (h/2) + r->pixheight * py;
+    ray->direction[2] = 1;
+    normalize(ray->direction);
+    ray->weight = 1;
+    ray->sample = sample;
+    ray->depth = 0;
+    ray->cell = r->raster ? screen_cell(r, px, py) : -1;
+}
+
+// flat normal of triangle t, facing the side its corners run counter
+// clockwise around
+static inline void triangle_normal(int t, real* N) {
+    int* index = &scene.triangle_vertex[3*(size_t)t];
+    real* a = &scene.mesh_vertex[3*(size_t)index[0]];
+    real* b = &scene.mesh_vertex[3*(size_t)index[1]];
+    real* c = &scene.mesh_vertex[3*(size_t)index[2]];
+    real e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    real e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    N[0] = e1[1]*e2[2] - e1[2]*e2[1];
+    N[1] = e1[2]*e2[0] - e1[0]*e2[2];
+    N[2] = e1[0]*e2[1] - e1[1]*e2[0];
+    normalize(N);
+}
+
+// intersect stage, find what every ray of the generation hits
+void intersect_rays(Render* r, Tracer* tr) {
+    for (int i = 0; i < tr->current.count; i++) {
+        Ray* ray = &tr->current.rays[i];
+        real t;
+        if (ray->cell >= 0) {
+            ray->hit = screen_hit(&tr->stats, &r->bins, ray->cell, ray->origin, ray->direction, &t);
+        } else {
+            ray->hit = closest_hit(&tr->stats, ray->origin, ray->direction, &t);
+        }
+        if (ray->hit < 0) {
+            continue;
+        }
+        ray->distance = t;
+        for (int k = 0; k < 3; k++) {
+            ray->point[k] = t*ray->direction[k] + ray->origin[k];
+        }
+        if (ray->hit < scene.sphere_count) {
+            for (int k = 0; k < 3; k++) {
+                ray->normal[k] = ray->point[k] - scene.sphere_center[k][ray->hit];
+            }
+            normalize(ray->normal);
+        } else if (ray->hit < scene.sphere_count + scene.plane_count) {
+            // plane normals are normalized when the scene is compiled
+            for (int k = 0; k < 3; k++) {
+                ray->normal[k] = scene.plane_normal[k][ray->hit - scene.sphere_count];
+            }
+        } else {
+            triangle_normal(ray->hit - scene.sphere_count - scene.plane_count, ray->normal);
+        }
+    }
+}
+
+static inline Material* hit_material(int id) {
+    if (id < scene.sphere_count) {
+        return &scene.materials[scene.sphere_material[id]];
+    }
+    if (id < scene.sphere_count + scene.plane_count) {
+        return &scene.materials[scene.plane_material[id - scene.sphere_count]];
+    }
+    return &scene.materials[scene.triangle_material[id - scene.sphere_count - scene.plane_count]];
+}
+
+// append a shadow ray to the tracer's list, growing it as needed
+static inline Shadow* push_shadow(Tracer* tr) {
+    if (tr->shadow_count == tr->shadow_capacity) {
+        tr->shadow_capacity = tr->shadow_capacity ? 2 * tr->shadow_capacity : 1024;
+        tr->shadows = realloc(tr->shadows, sizeof(Shadow)*tr->shadow_capacity);
+        tr->shadow_order = realloc(tr->shadow_order, sizeof(int)*tr->shadow_capacity);
+        if (tr->shadows == NULL || tr->shadow_order == NULL) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            exit(1);
+        }
+    }
+    return &tr->shadows[tr->shadow_count++];
+}
+
+// keep light_samples of a hit's lights, picked with odds in proportion to
+// how bright each could be there and scaled up to make up for the rest.
+// lights whose brightness can't be estimated are always kept
+void select_lights(Render* r, Tracer* tr, Ray* ray) {
+    LightIndex* li = &r->lights;
+    Shadow* s = &tr->shadows[ray->shadow_first];
+    int n = ray->shadow_count;
+    int k = r->light_samples;
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        Light* l = &scene.lights[s[i].light];
+        double w = li->bound[s[i].light] * fradial(l->radial[2], l->radial[1], l->radial[0], s[i].distance);
+        s[i].blocked = 0;
+        if (w > 0 && w < INFINITY) {
+            total += w;
+            s[i].scale = total;  // running sum until the picks are made
+        } else {
+            s[i].scale = -1;
+        }
+    }
+    if (!(total > 0)) {
+        for (int i = 0; i < n; i++) s[i].scale = 1;
+        return;
+    }
+
+    // picks depend only on where the hit is, so they don't change with threads
+    // (hashed as doubles so both precisions pick from the same bits layout)
+    double point[3] = {ray->point[0], ray->point[1], ray->point[2]};
+    unsigned long long bits[3];
+    memcpy(bits, point, sizeof(bits));
+    unsigned int hx = (unsigned int)(bits[0] ^ bits[0] >> 32) ^ (unsigned int)(bits[2] ^ bits[2] >> 32) * 0x9e3779b9u;
+    unsigned int hy = (unsigned int)(bits[1] ^ bits[1] >> 32);
+    for (int j = 0; j < k; j++) {
+        double u = sample_jitter(hx, hy, j) * total;
+        int lo = 0;
+        int hi = n - 1;
+        // first light whose running sum passes u
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (s[mid].scale >= 0 && s[mid].scale > u) {
+                hi = mid;
+            } else if (s[mid].scale < 0) {
+                // unestimated lights hold no share, look at the nearest estimated one
+                int m = mid;
+                while (m < hi && s[m].scale < 0) m++;
+                if (s[m].scale > u) hi = m; else lo = m + 1;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        s[lo].blocked++;
+    }
+
+    int out = 0;
+    double previous = 0;
+    for (int i = 0; i < n; i++) {
+        if (s[i].scale < 0) {
+            s[i].scale = 1;
+            s[out++] = s[i];
+            continue;
+        }
+        double w = s[i].scale - previous;
+        previous = s[i].scale;
+        if (s[i].blocked > 0) {
+            s[i].scale = s[i].blocked * total / (k * w);
+            s[i].blocked = 0;
+            s[out++] = s[i];
+        }
+    }
+    STAT_ADD(&tr->stats, culled_lights, n - out);
+    ray->shadow_count = out;
+    tr->shadow_count = ray->shadow_first + out;
+}
+
+// set up the shadow ray from a hit at point with normal N towards light l,
+// and tell whether the light can reach it at all: within radius, in front
+// of the surface and inside its cone
+static inline int light_reaches(Light* l, double radius, real* point, real* N, Shadow* s) {
+    for (int k = 0; k < 3; k++) {
+        s->direction[k] = l->position[k] - point[k];
+    }
+    // distance to the light, shadow rays only care about hits before it
+    s->distance = magnitude(s->direction);
+    normalize(s->direction);
+    // the same tests that zero the diffuse and specular terms and the cone
+    real L[3] = {s->direction[0], s->direction[1], s->direction[2]};
+    normalize(L);
+    if (s->distance > radius || dot(N, L) <= 0) {
+        return 0;
+    }
+    if (l->kind & LIGHT_SPOT) {
+        real nL[3] = {-L[0], -L[1], -L[2]};
+        if (dot(nL, l->axis) < l->cos_cutoff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// queue a shadow ray from a hit towards every light that can light it,
+// leaving out lights out of range, facing away from it or with the hit
+// outside their cone
+void gather_lights(Render* r, Tracer* tr, Ray* ray, int index) {
+    LightIndex* li = &r->lights;
+    int* cell = NULL;
+    int cell_count = light_cell(li, ray->point, &cell);
+    int g = 0;
+    int c = 0;
+    ray->shadow_first = tr->shadow_count;
+    // the global and cell lists never share a light, merge them in order
+    while (g < li->global_count || c < cell_count) {
+        int i;
+        if (c >= cell_count || (g < li->global_count && li->global[g] < cell[c])) {
+            i = li->global[g++];
+        } else {
+            i = cell[c++];
+        }
+        Shadow* s = push_shadow(tr);
+        if (!light_reaches(&scene.lights[i], li->radius[i], ray->point, ray->normal, s)) {
+            tr->shadow_count--;
+            continue;
+        }
+        s->scale = 1;
+        s->light = i;
+        s->ray = index;
+    }
+    ray->shadow_count = tr->shadow_count - ray->shadow_first;
+    STAT_ADD(&tr->stats, culled_lights, scene.light_count - ray->shadow_count);
+    if (r->light_samples > 0 && ray->shadow_count > r->light_samples) {
+        select_lights(r, tr, ray);
+    }
+}
+
+// trace the queued shadow rays grouped by light, which keeps walks towards
+// the same light together and lets them share its occluder cache
+void trace_shadows(Tracer* tr) {
+    int lights = scene.light_count;
+    int* start = tr->light_start;
+    memset(start, 0, sizeof(int)*(lights + 1));
+    for (int k = 0; k < tr->shadow_count; k++) {
+        start[tr->shadows[k].light + 1]++;
+    }
+    for (int i = 0; i < lights; i++) {
+        start[i + 1] += start[i];
+    }
+    for (int k = 0; k < tr->shadow_count; k++) {
+        tr->shadow_order[start[tr->shadows[k].light]++] = k;
+    }
+    for (int o = 0; o < tr->shadow_count; o++) {
+        Shadow* s = &tr->shadows[tr->shadow_order[o]];
+        Ray* ray = &tr->current.rays[s->ray];
+        STAT_ADD(&tr->stats, shadow_rays, 1);
+        s->blocked = occluded(&tr->stats, ray->point, s->direction, s->distance,
+                              ray->hit, &tr->occluder[s->light]) >= 0;
+        if (s->blocked) {
+            STAT_ADD(&tr->stats, occluded, 1);
+        } else {
+            STAT_ADD(&tr->stats, lit, 1);
+        }
+    }
+}
+
+// add what one unblocked light gives a hit to all three channels of color.
+// spot and attenuated are constants at every call, so each kind of light
+// gets its own kernel with the tests it doesn't need folded away. the
+// diffuse term needs no test since gather_lights() drops lights behind
+// the surface
+static inline void shade_light(real* color, Light* l, Material* mat, Shadow* s,
+                               real* N, real* V, const int spot, const int attenuated) {
+    real L[3] = {s->direction[0], s->direction[1], s->direction[2]};
+    normalize(L);
+    real factor = 1;
+    if (spot) {
+        real nL[3] = {-L[0], -L[1], -L[2]};
+        factor *= pow(dot(nL, l->axis), l->angular);
+    }
+    if (attenuated) {
+        factor *= fradial(l->radial[2], l->radial[1], l->radial[0], s->distance);
+    }
+    real diffuse = dot(N, L);
+    real specular = 0;
+    if (mat->glossy) {
+        real R[3];
+        reflect(L, N, R);
+        real cosr = dot(V, R);
+        if (cosr > 0) specular = power(cosr, mat->shininess);
+    }
+    real scale = s->scale;
+    for (int c = 0; c < 3; c++) {
+        real Il = l->color[c];
+        color[c] += factor * (mat->diffuse[c] * Il * diffuse + mat->specular[c] * Il * specular) * scale;
+    }
+}
+
+// shade_light() with the kernel for l's kind
+static inline void shade_kind(real* color, Light* l, Material* mat, Shadow* s, real* N, real* V) {
+    switch (l->kind) {
+    case 0:
+        shade_light(color, l, mat, s, N, V, 0, 0);
+        break;
+    case LIGHT_SPOT:
+        shade_light(color, l, mat, s, N, V, 1, 0);
+        break;
+    case LIGHT_ATTENUATED:
+        shade_light(color, l, mat, s, N, V, 0, 1);
+        break;
+    default:
+        shade_light(color, l, mat, s, N, V, 1, 1);
+        break;
+    }
+}
+
+// shade stage. hits queue shadow rays only towards lights that can reach
+// them; the shadow rays are traced a light at a time so the bvh walks
+// towards one light stay together, then each hit adds up its lights in
+// scene order. the sum is clamped once, when trace_batch() takes it
+void shade_rays(Render* r, Tracer* tr) {
+    Ray* rays = tr->current.rays;
+    int count = tr->current.count;
+    int first = 0;
+    while (first < count) {
+        // hits shaded together are capped by how many shadow rays they need
+        int end = first;
+        tr->shadow_count = 0;
+        while (end < count && tr->shadow_count < SHADOW_BATCH) {
+            if (rays[end].hit >= 0) {
+                gather_lights(r, tr, &rays[end], end);
+            }
+            end++;
+        }
+        trace_shadows(tr);
+
+        for (int j = first; j < end; j++) {
+            Ray* ray = &rays[j];
+            if (ray->hit < 0) {
+                continue;
+            }
+            Material* mat = hit_material(ray->hit);
+            real* N = ray->normal;
+            real* color = ray->color;
+            color[0] = 0;
+            color[1] = 0;
+            color[2] = 0;
+            for (int k = ray->shadow_first; k < ray->shadow_first + ray->shadow_count; k++) {
+                Shadow* s = &tr->shadows[k];
+                if (s->blocked) {
+                    continue;
+                }
+                shade_kind(color, &scene.lights[s->light], mat, s, N, ray->direction);
+            }
+        }
+        first = end;
+    }
+}
+
+// queue the reflection and refraction of a hit for the next generation
+void spawn_rays(Tracer* tr, Ray* ray, Material* mat) {
+    if (ray->depth + 1 >= TRACE_DEPTH) {
+        return;
+    }
+    real* D = ray->direction;
+    real* N = ray->normal;
+    // the normal on the side the ray came from
+    real cosi = -dot(D, N);
+    real side = cosi >= 0 ? 1 : -1;
+    real Nf[3] = {side*N[0], side*N[1], side*N[2]};
+    cosi *= side;
+    real offset = RAY_OFFSET(ray->point);
+    real reflected = ray->weight * mat->reflectivity;
+    real refracted = ray->weight * mat->refractivity;
+
+    if (refracted >= MIN_WEIGHT) {
+        // going in through a front face, or back out through a back face
+        real eta = side > 0 ? 1 / mat->ior : mat->ior;
+        real k = 1 - eta*eta*(1 - cosi*cosi);
+        if (k < 0) {
+            // total internal reflection, the refracted share is reflected
+            reflected += refracted;
+        } else {
+            Ray* out = queue_push(&tr->refracted);
+            for (int c = 0; c < 3; c++) {
+                out->direction[c] = eta*D[c] + (eta*cosi - sqrt(k))*Nf[c];
+            }
+            normalize(out->direction);
+            for (int c = 0; c < 3; c++) {
+                out->origin[c] = ray->point[c] - offset*Nf[c];
+            }
+            out->weight = refracted;
+            out->sample = ray->sample;
+            out->depth = ray->depth + 1;
+            out->cell = -1;
+        }
+    }
+    if (reflected >= MIN_WEIGHT) {
+        Ray* out = queue_push(&tr->reflected);
+        reflect(D, N, out->direction);
+        normalize(out->direction);
+        for (int c = 0; c < 3; c++) {
+            out->origin[c] = ray->point[c] + offset*Nf[c];
+        }
+        out->weight = reflected;
+        out->sample = ray->sample;
+        out->depth = ray->depth + 1;
+        out->cell = -1;
+    }
+}
+
+// trace every queued primary ray and everything it spawns into the sample
+// colors of the batch. primed primary rays already hold their hits, taken
+// from a g-buffer; hits, when not NULL, records each sample's primary hit
+void trace_batch(Render* r, Tracer* tr, int primed, GBufferPixel* hits) {
+    for (int i = 0; i < tr->current.count; i++) {
+        tr->sample_id[tr->current.rays[i].sample] = -1;
+    }
+    if (!primed) {
+        STAT_ADD(&tr->stats, primary_rays, tr->current.count);
+    }
+    while (tr->current.count > 0) {
+        double start = STAT_CLOCK(r->timing);
+        if (!primed) {
+            intersect_rays(r, tr);
+        }
+        primed = 0;
+        double hit = STAT_CLOCK(r->timing);
+        STAT_SPAN(&tr->stats, trace_seconds, start, hit);
+
+        shade_rays(r, tr);
+        for (int i = 0; i < tr->current.count; i++) {
+            Ray* ray = &tr->current.rays[i];
+            if (ray->depth == 0) {
+                tr->sample_id[ray->sample] = ray->hit;
+                if (hits != NULL) {
+                    GBufferPixel* g = &hits[ray->sample];
+                    g->id = ray->hit;
+                    g->material = ray->hit >= 0 ? hit_material(ray->hit) - scene.materials : -1;
+                    g->distance = ray->hit >= 0 ? ray->distance : 0;
+                    for (int k = 0; k < 3; k++) {
+                        g->normal[k] = ray->hit >= 0 ? ray->normal[k] : 0;
+                        g->lit[k] = ray->hit >= 0 ? ray->color[k] : 0;
+                    }
+                }
+            }
+            if (ray->hit < 0) {
+                continue;
+            }
+            Material* mat = hit_material(ray->hit);
+            double local = ray->weight * (1 - mat->reflectivity - mat->refractivity);
+            double* sample = &tr->sample_color[3 * ray->sample];
+            double* light = &tr->sample_light[3 * ray->sample];
+            for (int c = 0; c < 3; c++) {
+                sample[c] += local * clamp(ray->color[c]);
+                light[c] += local * unclamped(ray->color[c]);
+            }
+            spawn_rays(tr, ray, mat);
+        }
+        STAT_SPAN(&tr->stats, shade_seconds, hit, STAT_CLOCK(r->timing));
+
+        // the next generation is every reflection followed by every refraction
+        RayQueue done = tr->current;
+        tr->current = tr->reflected;
+        tr->reflected = done;
+        tr->reflected.count = 0;
+        for (int i = 0; i < tr->refracted.count; i++) {
+            *queue_push(&tr->current) = tr->refracted.rays[i];
+        }
+        tr->refracted.count = 0;
+        STAT_ADD(&tr->stats, secondary_rays, tr->current.count);
+    }
+}
+
+// first pass pixels whose channels differ from a neighbour by more than
+// this are supersampled even when they show the same object
+#define AA_CONTRAST 24
+
+// offset of a full image pixel in the cropped buffers
+static inline size_t pixel_index(Render* r, int x, int row) {
+    return (size_t)(row - r->top) * r->cols + (x - r->left);
+}
+
+// does a first pass pixel sit on an object edge or a sharp color change
+int is_edge(Render* r, int x, int row) {
+    size_t p = pixel_index(r, x, row);
+    Pixel* a = &r->first_image[p];
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int nx = x + dx;
+            int ny = row + dy;
+            if ((dx == 0 && dy == 0) || nx < r->left || ny < r->top ||
+                nx >= r->left + r->cols || ny >= r->top + r->rows) {
+                continue;
+            }
+            size_t q = pixel_index(r, nx, ny);
+            Pixel* b = &r->first_image[q];
+            if (r->first_id[q] != r->first_id[p] ||
+                abs(a->red - b->red) > AA_CONTRAST ||
+                abs(a->green - b->green) > AA_CONTRAST ||
+                abs(a->blue - b->blue) > AA_CONTRAST) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// store a traced color into the image buffers; float images take the
+// unclamped light instead, which can go over 1
+static inline void store_pixel(Render* r, int x, int row, double* color, double* light) {
+    Pixel new;
+    new.red = color[0];
+    new.green = color[1];
+    new.blue = color[2];
+    r->image[pixel_index(r, x, row)] = new;
+    if (r->hdr != NULL) {
+        // float images are stored bottom row first
+        float* out = &r->hdr[3 * pixel_index(r, x, r->top + r->rows - 1 - (row - r->top))];
+        out[0] = light[0] / 255;
+        out[1] = light[1] / 255;
+        out[2] = light[2] / 255;
+    }
+}
+
+// tiles are square blocks of pixels handed out to worker threads
+#define TILE_SIZE 16
+
+// double ended queue of tile indices owned by one worker; the owner
+// pops from the bottom and idle workers steal from the top
+typedef struct {
+    pthread_mutex_t lock;
+    int* tiles;
+    int top;
+    int bottom;
+} TileDeque;
+
+typedef struct {
+    Render* render;
+    TileDeque* deques;
+    int id;
+    int count;
+    int tiles_x;
+} Worker;
+
+// take a tile from the bottom of our own queue
+int deque_pop(TileDeque* q) {
+    int tile = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        q->bottom--;
+        tile = q->tiles[q->bottom];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return tile;
+}
+
+// take a tile from the top of somebody else's queue
+int deque_steal(TileDeque* q) {
+    int tile = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        tile = q->tiles[q->top];
+        q->top++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return tile;
+}
+
+// what the lights changed since the previous g-buffer do to a pixel: 0
+// none reaches its hit in either version, 1 only the hit's own shading
+// changes, 2 it has to be traced again. a hit that reflects or refracts
+// can see a changed light anywhere, and with --light-samples a changed
+// light changes which of the others get picked
+int gbuffer_affected(Render* r, GBufferPixel* pixel, real* point) {
+    GBuffer* g = r->gbuffer;
+    if (pixel->id < 0) {
+        return 0;
+    }
+    Material* m = &scene.materials[pixel->material];
+    if (m->reflectivity > 0 || m->refractivity > 0) {
+        return 2;
+    }
+    Shadow s;
+    for (int c = 0; c < g->changed_count; c++) {
+        int i = g->changed[c];
+        if ((i < g->previous->light_count &&
+             light_reaches(&g->previous_lights[i], g->previous_radius[i], point, pixel->normal, &s)) ||
+            (i < scene.light_count && light_reaches(&scene.lights[i], g->radius[i], point, pixel->normal, &s))) {
+            return r->light_samples > 0 ? 2 : 1;
+        }
+    }
+    return 0;
+}
+
+// shade a primary hit again for only the changed lights: take what each
+// gave it before off the light saved with it and add what it gives now.
+// the geometry is the same, so old shadow rays are traced as they were
+void gbuffer_relight(Render* r, Tracer* tr, GBufferPixel* pixel, Ray* ray) {
+    GBuffer* g = r->gbuffer;
+    Material* mat = &scene.materials[pixel->material];
+    real* lit = pixel->lit;
+    Shadow s;
+    s.scale = 1;
+    for (int c = 0; c < g->changed_count; c++) {
+        int i = g->changed[c];
+        real before[3] = {0, 0, 0};
+        real after[3] = {0, 0, 0};
+        int cache = -1;
+        if (i < g->previous->light_count &&
+            light_reaches(&g->previous_lights[i], g->previous_radius[i], ray->point, ray->normal, &s)) {
+            STAT_ADD(&tr->stats, shadow_rays, 1);
+            if (occluded(&tr->stats, ray->point, s.direction, s.distance, ray->hit, &cache) < 0) {
+                shade_kind(before, &g->previous_lights[i], mat, &s, ray->normal, ray->direction);
+            }
+        }
+        if (i < scene.light_count &&
+            light_reaches(&scene.lights[i], g->radius[i], ray->point, ray->normal, &s)) {
+            STAT_ADD(&tr->stats, shadow_rays, 1);
+            if (occluded(&tr->stats, ray->point, s.direction, s.distance, ray->hit, &tr->occluder[i]) < 0) {
+                shade_kind(after, &scene.lights[i], mat, &s, ray->normal, ray->direction);
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            lit[k] += after[k] - before[k];
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        pixel->color[k] = clamp(lit[k]);
+        pixel->light[k] = unclamped(lit[k]);
+    }
+}
+
+// first pass of a tile from the previous g-buffer, without primary rays.
+// pixels no changed light reaches keep their color, plain hits are shaded
+// again for the changed lights alone and the rest are traced again from
+// their saved hits, coming out as a full render would
+void reshade_tile(Render* r, Tracer* tr, int x0, int y0, int x1, int y1) {
+    GBuffer* g = r->gbuffer;
+    int cols = x1 - x0;
+    int pixels[TILE_SIZE * TILE_SIZE];
+    int count = 0;
+    tracer_samples(tr, cols * (y1 - y0));
+    for (int row = y0; row < y1; row++) {
+        int y = r->height - row;
+        for (int x = x0; x < x1; x++) {
+            size_t p = pixel_index(r, x, row);
+            GBufferPixel* pixel = &g->pixels[p];
+            *pixel = g->previous_pixels[p];
+            push_primary(r, tr, x + 0.5, y + 0.5, count);
+            Ray* ray = &tr->current.rays[tr->current.count - 1];
+            ray->hit = pixel->id;
+            ray->distance = pixel->distance;
+            for (int k = 0; k < 3; k++) {
+                ray->point[k] = pixel->distance*ray->direction[k] + ray->origin[k];
+                ray->normal[k] = pixel->normal[k];
+            }
+            int affected = gbuffer_affected(r, pixel, ray->point);
+            if (affected < 2) {
+                if (affected) {
+                    gbuffer_relight(r, tr, pixel, ray);
+                    STAT_ADD(&tr->stats, relit_pixels, 1);
+                } else {
+                    STAT_ADD(&tr->stats, reused_pixels, 1);
+                }
+                tr->current.count--;
+                store_pixel(r, x, row, pixel->color, pixel->light);
+                if (r->first_id != NULL) {
+                    r->first_id[p] = pixel->id;
+                }
+                continue;
+            }
+            pixels[count++] = (row - y0) * cols + (x - x0);
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    STAT_ADD(&tr->stats, reshaded_pixels, count);
+    GBufferPixel hits[TILE_SIZE * TILE_SIZE];
+    trace_batch(r, tr, 1, hits);
+    for (int s = 0; s < count; s++) {
+        int x = x0 + pixels[s] % cols;
+        int row = y0 + pixels[s] / cols;
+        size_t p = pixel_index(r, x, row);
+        store_pixel(r, x, row, &tr->sample_color[3 * s], &tr->sample_light[3 * s]);
+        if (r->first_id != NULL) {
+            r->first_id[p] = tr->sample_id[s];
+        }
+        memcpy(g->pixels[p].lit, hits[s].lit, sizeof(hits[s].lit));
+        memcpy(g->pixels[p].color, &tr->sample_color[3 * s], sizeof(double)*3);
+        memcpy(g->pixels[p].light, &tr->sample_light[3 * s], sizeof(double)*3);
+    }
+}
+
+// a time budgeted render starts at one pixel in PROGRESSIVE_STRIDE squared
+// and halves the spacing each level down to every pixel; with --aa unset
+// its last level supersamples edges with PROGRESSIVE_AA squared samples
+#define PROGRESSIVE_STRIDE 8
+#define PROGRESSIVE_AA 3
+
+// pass 0 of a tile at one level of a time budgeted render. traces the
+// pixels on the level's grid that the coarser levels left out and paints
+// each over the block it stands for until a finer level traces the rest.
+// once every level is done each pixel has been traced once, as in a full
+// first pass
+void level_tile(Render* r, Tracer* tr, int x0, int y0, int x1, int y1) {
+    int step = r->stride;
+    int cols = x1 - x0;
+    int pixels[TILE_SIZE * TILE_SIZE];
+    int count = 0;
+    tracer_samples(tr, cols * (y1 - y0));
+    for (int row = y0 - y0 % step; row < y1; row += step) {
+        int y = r->height - row;
+        for (int x = x0 - x0 % step; x < x1; x += step) {
+            if (step < PROGRESSIVE_STRIDE && x % (2 * step) == 0 && row % (2 * step) == 0) {
+                continue;
+            }
+            push_primary(r, tr, x + 0.5, y + 0.5, count);
+            pixels[count++] = (row - y0) * cols + (x - x0);
+        }
+    }
+    trace_batch(r, tr, 0, NULL);
+    for (int s = 0; s < count; s++) {
+        int x = x0 + pixels[s] % cols;
+        int row = y0 + pixels[s] / cols;
+        for (int by = row; by < row + step && by < y1; by++) {
+            for (int bx = x; bx < x + step && bx < x1; bx++) {
+                store_pixel(r, bx, by, &tr->sample_color[3 * s], &tr->sample_light[3 * s]);
+                if (r->first_id != NULL) {
+                    r->first_id[pixel_index(r, bx, by)] = tr->sample_id[s];
+                }
+            }
+        }
+    }
+}
+
+// render every pixel of one tile into the image, as one batch of rays
+void render_tile(Render* r, Tracer* tr, int tile, int tiles_x) {
+    int x0 = r->left + (tile % tiles_x) * TILE_SIZE;
+    int y0 = r->top + (tile / tiles_x) * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE < r->left + r->cols ? x0 + TILE_SIZE : r->left + r->cols;
+    int y1 = y0 + TILE_SIZE < r->top + r->rows ? y0 + TILE_SIZE : r->top + r->rows;
+    int cols = x1 - x0;
+    if (r->pass == 0 && r->stride > 0) {
+        level_tile(r, tr, x0, y0, x1, y1);
+        return;
+    }
+    if (r->pass == 0 && r->gbuffer != NULL && r->gbuffer->previous != NULL) {
+        reshade_tile(r, tr, x0, y0, x1, y1);
+        return;
+    }
+    if (r->pass == 0) {
+        // one ray through the center of each pixel; row 0 is the top of the image
+        tracer_samples(tr, cols * (y1 - y0));
+        for (int row = y0; row < y1; row++) {
+            int y = r->height - row;
+            for (int x = x0; x < x1; x++) {
+                push_primary(r, tr, x + 0.5, y + 0.5, (row - y0) * cols + (x - x0));
+            }
+        }
+        GBufferPixel hits[TILE_SIZE * TILE_SIZE];
+        trace_batch(r, tr, 0, r->gbuffer != NULL ? hits : NULL);
+        for (int row = y0; row < y1; row++) {
+            for (int x = x0; x < x1; x++) {
+                int s = (row - y0) * cols + (x - x0);
+                store_pixel(r, x, row, &tr->sample_color[3 * s], &tr->sample_light[3 * s]);
+                if (r->first_id != NULL) {
+                    r->first_id[pixel_index(r, x, row)] = tr->sample_id[s];
+                }
+                if (r->gbuffer != NULL) {
+                    GBufferPixel* g = &r->gbuffer->pixels[pixel_index(r, x, row)];
+                    *g = hits[s];
+                    memcpy(g->color, &tr->sample_color[3 * s], sizeof(g->color));
+                    memcpy(g->light, &tr->sample_light[3 * s], sizeof(g->light));
+                }
+            }
+        }
+        return;
+    }
+
+    // pixels on edges average aa x aa jittered stratified samples, everything
+    // else keeps its first pass color
+    int n = r->aa;
+    int edges[TILE_SIZE * TILE_SIZE];
+    int count = 0;
+    Render* in = r->inner;
+    for (int row = y0; row < y1; row++) {
+        for (int x = x0; x < x1; x++) {
+            // border pixels only feed edge detection, their colors are dropped
+            if (in != NULL && (x < in->left || x >= in->left + in->cols ||
+                               row < in->top || row >= in->top + in->rows)) {
+                continue;
+            }
+            if (is_edge(r, x, row)) {
+                edges[count++] = (row - y0) * cols + (x - x0);
+            }
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    tracer_samples(tr, count * n * n);
+    for (int e = 0; e < count; e++) {
+        int x = x0 + edges[e] % cols;
+        int row = y0 + edges[e] / cols;
+        int y = r->height - row;
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                int s = j * n + i;
+                double px = x + (i + sample_jitter(x, row, 2*s)) / n;
+                double py = y + (j + sample_jitter(x, row, 2*s + 1)) / n;
+                push_primary(r, tr, px, py, e * n * n + s);
+            }
+        }
+    }
+    trace_batch(r, tr, 0, NULL);
+    for (int e = 0; e < count; e++) {
+        double color[3] = {0, 0, 0};
+        double light[3] = {0, 0, 0};
+        for (int s = 0; s < n * n; s++) {
+            for (int c = 0; c < 3; c++) {
+                color[c] += tr->sample_color[3 * (e * n * n + s) + c];
+                light[c] += tr->sample_light[3 * (e * n * n + s) + c];
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            color[c] /= n * n;
+            light[c] /= n * n;
+        }
+        STAT_ADD(&tr->stats, antialiased_pixels, 1);
+        store_pixel(r, x0 + edges[e] % cols, y0 + edges[e] / cols, color, light);
+    }
+}
+
+// render a tile unless a checkpoint has it as done or the time budget has
+// run out, and mark it done after. the coarsest level of a time budgeted
+// render always finishes so that every pixel has a color
+void run_tile(Render* r, Tracer* tr, int tile, int tiles_x) {
+    if (r->deadline > 0 && r->stride != PROGRESSIVE_STRIDE && now_seconds() >= r->deadline) {
+        __atomic_add_fetch(&r->tiles_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (r->tiles_done == NULL) {
+        render_tile(r, tr, tile, tiles_x);
+        return;
+    }
+    unsigned char* done = &r->tiles_done[r->pass * r->checkpoint->tile_count + tile];
+    if (*done) {
+        return;
+    }
+    render_tile(r, tr, tile, tiles_x);
+    // the flag goes in after the pixels; a process killed in between just
+    // renders the tile again
+    __atomic_store_n(done, 1, __ATOMIC_RELEASE);
+}
+
+// worker loop, drain our own queue then go stealing until everything is empty
+void* render_worker(void* arg) {
+    Worker* self = arg;
+    Tracer tr;
+    int tile;
+    tracer_init(&tr);
+    while (1) {
+        while ((tile = deque_pop(&self->deques[self->id])) >= 0) {
+            run_tile(self->render, &tr, tile, self->tiles_x);
+        }
+        int stolen = 0;
+        for (int k = 1; k < self->count && !stolen; k++) {
+            int victim = (self->id + k) % self->count;
+            tile = deque_steal(&self->deques[victim]);
+            if (tile >= 0) {
+                run_tile(self->render, &tr, tile, self->tiles_x);
+                stolen = 1;
+            }
+        }
+        // tiles are never added after startup, so nothing left to steal means done
+        if (!stolen) {
+            tracer_free(self->render, &tr);
+            return NULL;
+        }
+    }
+}
+
+// run one pass over every tile with the given number of threads
+void render_pass(Render* r, int threads) {
+    int tiles_x = (r->cols + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (r->rows + TILE_SIZE - 1) / TILE_SIZE;
+    int tile_count = tiles_x * tiles_y;
+
+    if (threads <= 1) {
+        Tracer tr;
+        tracer_init(&tr);
+        for (int i = 0; i < tile_count; i++) {
+            run_tile(r, &tr, r->tile_order != NULL ? r->tile_order[i] : i, tiles_x);
+        }
+        tracer_free(r, &tr);
+        return;
+    }
+
+    TileDeque* deques = malloc(sizeof(TileDeque)*threads);
+    Worker* workers = malloc(sizeof(Worker)*threads);
+    pthread_t* ids = malloc(sizeof(pthread_t)*threads);
+
+    // hand each worker a contiguous run of tiles so neighbours stay together
+    for (int i = 0; i < threads; i++) {
+        int first = (int)((long)tile_count * i / threads);
+        int last = (int)((long)tile_count * (i + 1) / threads);
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].tiles = malloc(sizeof(int)*(last - first + 1));
+        deques[i].top = 0;
+        deques[i].bottom = 0;
+        // pushed in reverse so the owner pops its tiles in order
+        for (int k = last - 1; k >= first; k--) {
+            deques[i].tiles[deques[i].bottom++] = r->tile_order != NULL ? r->tile_order[k] : k;
+        }
+        workers[i].render = r;
+        workers[i].deques = deques;
+        workers[i].id = i;
+        workers[i].count = threads;
+        workers[i].tiles_x = tiles_x;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, render_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Error: Could not start render thread.\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].tiles);
+    }
+    free(deques);
+    free(workers);
+    free(ids);
+}
+
+// keep each light's reach in this render for the g-buffer and, when there
+// is a previous one, work out which lights differ from the ones it was
+// shaded with; runs once the light index is built
+void gbuffer_lights(Render* r) {
+    GBuffer* g = r->gbuffer;
+    int n = scene.light_count;
+    free(g->radius);
+    g->radius = malloc(sizeof(double)*(n + 1));
+    memcpy(g->radius, r->lights.radius, sizeof(double)*n);
+    if (g->previous == NULL) {
+        return;
+    }
+    int before = g->previous->light_count;
+    int most = n > before ? n : before;
+    free(g->changed);
+    g->changed = malloc(sizeof(int)*(most + 1));
+    g->changed_count = 0;
+    for (int i = 0; i < most; i++) {
+        // a light whose reach moved counts too, the grid can change it
+        if (i >= n || i >= before || g->radius[i] != g->previous_radius[i] ||
+            memcmp(&scene.lights[i], &g->previous_lights[i], sizeof(Light)) != 0) {
+            g->changed[g->changed_count++] = i;
+        }
+    }
+    fprintf(stderr, "Note: Reusing the g-buffer's hits, %d of %d lights changed.\n", g->changed_count, most);
+}
+
+// tiles a few apart first, then those between them, so that the part of
+// a level done by the deadline is spread over the whole image
+int* interleaved_tiles(int tiles_x, int tiles_y) {
+    int* order = malloc(sizeof(int)*tiles_x*tiles_y);
+    int count = 0;
+    for (int step = 4; step >= 1; step /= 2) {
+        for (int ty = 0; ty < tiles_y; ty += step) {
+            for (int tx = 0; tx < tiles_x; tx += step) {
+                if (step < 4 && tx % (2 * step) == 0 && ty % (2 * step) == 0) {
+                    continue;
+                }
+                order[count++] = ty * tiles_x + tx;
+            }
+        }
+    }
+    return order;
+}
+
+// pass 0 of a time budgeted render, level by level from the coarsest grid
+// to every pixel until the deadline. leaves r->level at the levels that
+// finished and r->level_tiles at how much of the next one got done
+void render_levels(Render* r, int threads) {
+    int tiles_x = (r->cols + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (r->rows + TILE_SIZE - 1) / TILE_SIZE;
+    r->tile_order = interleaved_tiles(tiles_x, tiles_y);
+    r->level = 0;
+    r->level_tiles = 0;
+    for (int step = PROGRESSIVE_STRIDE; step >= 1; step /= 2) {
+        r->stride = step;
+        r->tiles_skipped = 0;
+        render_pass(r, threads);
+        if (r->tiles_skipped > 0) {
+            r->level_tiles = tiles_x * tiles_y - r->tiles_skipped;
+            break;
+        }
+        r->level++;
+    }
+    r->stride = 0;
+}
+
+// levels of a time budgeted render: one for each grid, then the edge samples
+static inline int render_level_count(Render* r) {
+    int levels = 1;
+    for (int step = PROGRESSIVE_STRIDE; step > 1; step /= 2) {
+        levels++;
+    }
+    return r->aa > 1 ? levels + 1 : levels;
+}
+
+// render every pixel of the buffers; with antialiasing on, a first pass
+// traces every pixel once and a second supersamples only the pixels on edges
+void render_passes(Render* r, int threads) {
+    size_t pixels = (size_t)r->cols * r->rows;
+    if (r->gbuffer != NULL) {
+        gbuffer_lights(r);
+    }
+    if (r->aa > 1 && r->first_id == NULL) {
+        r->first_id = malloc(sizeof(int)*pixels);
+    }
+    r->pass = 0;
+    if (r->deadline > 0) {
+        render_levels(r, threads);
+        // edges can only be found once every pixel has been traced
+        if (r->level < render_level_count(r) - (r->aa > 1)) {
+            return;
+        }
+    } else {
+        render_pass(r, threads);
+    }
+    if (r->aa > 1) {
+        if (r->first_image == NULL) {
+            r->first_image = malloc(sizeof(Pixel)*pixels);
+        }
+        // a resumed second pass has already changed part of the image, its
+        // first pass copy is in the checkpoint
+        if (r->checkpoint == NULL || !r->checkpoint->first_saved) {
+            memcpy(r->first_image, r->image, sizeof(Pixel)*pixels);
+            if (r->checkpoint != NULL) {
+                r->checkpoint->first_saved = 1;
+            }
+        }
+        r->pass = 1;
+        r->tiles_skipped = 0;
+        render_pass(r, threads);
+        r->pass = 0;
+        if (r->deadline > 0) {
+            int tiles = ((r->cols + TILE_SIZE - 1) / TILE_SIZE) * ((r->rows + TILE_SIZE - 1) / TILE_SIZE);
+            if (r->tiles_skipped > 0) {
+                r->level_tiles = tiles - r->tiles_skipped;
+            } else {
+                r->level++;
+            }
+        }
+    }
+}
+
+// tell how far a time budgeted render got, on stderr so tooling can pick
+// budgets from it
+void report_levels(Render* r) {
+    int levels = render_level_count(r);
+    char name[64];
+    // the coarsest level always finishes, so r->level is at least 1
+    if (r->level < levels - (r->aa > 1) || r->aa == 1) {
+        int step = PROGRESSIVE_STRIDE >> (r->level - 1);
+        if (step > 1) {
+            snprintf(name, sizeof(name), "1/%d resolution", step);
+        } else {
+            snprintf(name, sizeof(name), "full resolution");
+        }
+    } else {
+        snprintf(name, sizeof(name), "%dx%d edge samples", r->aa, r->aa);
+    }
+    if (r->level < levels) {
+        int tiles = ((r->cols + TILE_SIZE - 1) / TILE_SIZE) * ((r->rows + TILE_SIZE - 1) / TILE_SIZE);
+        fprintf(stderr, "Note: Time budget reached level %d of %d (%s) and %d of %d tiles of level %d.\n",
+                r->level, levels, name, r->level_tiles, tiles, r->level + 1);
+    } else {
+        fprintf(stderr, "Note: Time budget reached level %d of %d (%s).\n", r->level, levels, name);
+    }
+}
+
+// build what a render looks up while tracing, the light index and with
+// --raster the screen bins, from the scene as it is now
+void render_index(Render* r) {
+    light_index_build(&r->lights, r->light_cutoff);
+    if (r->raster) {
+        screen_bins_build(&r->bins, r);
+    }
+}
+
+void render_index_free(Render* r) {
+    light_index_free(&r->lights);
+    if (r->raster) {
+        screen_bins_free(&r->bins);
+    }
+}
+
+// render the crop held in the buffers. edge detection looks at the first
+// pass colors of the 8 neighbours, so with antialiasing a crop is traced
+// with a one pixel border of the full image around it and cut out again;
+// that way a crop is exactly the same pixels as in a render of everything
+void render_image(Render* r, int threads) {
+    if (!r->shared_index) {
+        render_index(r);
+    }
+    int x0 = r->left > 0 ? r->left - 1 : 0;
+    int y0 = r->top > 0 ? r->top - 1 : 0;
+    int x1 = r->left + r->cols < r->width ? r->left + r->cols + 1 : r->width;
+    int y1 = r->top + r->rows < r->height ? r->top + r->rows + 1 : r->height;
+    if (r->aa == 1 || (x0 == r->left && y0 == r->top &&
+                       x1 == r->left + r->cols && y1 == r->top + r->rows)) {
+        render_passes(r, threads);
+        if (!r->shared_index) {
+            render_index_free(r);
+        }
+        return;
+    }
+
+    Render wide = *r;
+    wide.left = x0;
+    wide.top = y0;
+    wide.cols = x1 - x0;
+    wide.rows = y1 - y0;
+    wide.image = malloc(sizeof(Pixel)*(size_t)wide.cols*wide.rows);
+    wide.hdr = r->hdr == NULL ? NULL : malloc(sizeof(float)*3*(size_t)wide.cols*wide.rows);
+    wide.first_image = NULL;
+    wide.first_id = NULL;
+    wide.inner = r;
+    pthread_mutex_init(&wide.stats_lock, NULL);
+    memset(&wide.stats, 0, sizeof(Stats));
+    render_passes(&wide, threads);
+
+    for (int row = r->top; row < r->top + r->rows; row++) {
+        memcpy(&r->image[pixel_index(r, r->left, row)], &wide.image[pixel_index(&wide, r->left, row)],
+               sizeof(Pixel)*r->cols);
+        if (r->hdr != NULL) {
+            // both float buffers run bottom row first
+            int from = wide.top + wide.rows - 1 - (row - wide.top);
+            int to = r->top + r->rows - 1 - (row - r->top);
+            memcpy(&r->hdr[3 * pixel_index(r, r->left, to)], &wide.hdr[3 * pixel_index(&wide, r->left, from)],
+                   sizeof(float)*3*r->cols);
+        }
+    }
+    stats_merge(&r->stats, &wide.stats);
+    if (!r->shared_index) {
+        render_index_free(r);
+    }
+    free(wide.image);
+    free(wide.hdr);
+    free(wide.first_image);
+    free(wide.first_id);
+    pthread_mutex_destroy(&wide.stats_lock);
+}
+
+// output formats
+#define FORMAT_P6 0
+#define FORMAT_P3 1
+#define FORMAT_PFM 2
+// p6 of a crop, with a comment placing it in the full image:
+//   P6
+//   # region width height x0 y0 x1 y1
+//   cols rows
+//   255
+// merge puts these back together; any ppm viewer still opens one
+#define FORMAT_PART 3
+
+// pick an output format from a --format name, or from the file extension
+int format_named(char* name) {
+    if (strcmp(name, "p6") == 0) return FORMAT_P6;
+    if (strcmp(name, "p3") == 0) return FORMAT_P3;
+    if (strcmp(name, "pfm") == 0) return FORMAT_PFM;
+    return -1;
+}
+
+// when name is NULL; binary p6 is the default
+int image_format(char* name, char* path) {
+    if (name != NULL) {
+        int format = format_named(name);
+        if (format < 0) {
+            fprintf(stderr, "Error: Unknown output format \"%s\".\n", name);
+            exit(1);
+        }
+        return format;
+    }
+    char* ext = strrchr(path, '.');
+    if (ext != NULL && strcmp(ext, ".pfm") == 0) {
+        return FORMAT_PFM;
+    }
+    return FORMAT_P6;
+}
+
+// write every byte described by iov, resuming after partial writes
+int write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// write the header of an image in the given format into header[128] and
+// return its length
+size_t image_header(Render* r, int format, char* header) {
+    if (format == FORMAT_P3) {
+        return sprintf(header, "P3\n%d %d\n%d\n", r->cols, r->rows, 255);
+    } else if (format == FORMAT_PFM) {
+        // negative scale marks little endian floats
+        return sprintf(header, "PF\n%d %d\n-1.0\n", r->cols, r->rows);
+    } else if (format == FORMAT_PART) {
+        return sprintf(header, "P6\n# region %d %d %d %d %d %d\n%d %d\n%d\n",
+                       r->width, r->height, r->left, r->top, r->left + r->cols,
+                       r->top + r->rows, r->cols, r->rows, 255);
+    }
+    return sprintf(header, "P6\n%d %d\n%d\n", r->cols, r->rows, 255);
+}
+
+// point iov[0] at the header, built in header[128], and iov[1] at the pixels
+// of an image; p3 text is allocated into *text for the caller to free
+void image_iov(Render* r, int format, char* header, struct iovec* iov, char** text) {
+    size_t pixels = (size_t)r->cols * r->rows;
+
+    *text = NULL;
+    if (format == FORMAT_P3) {
+        // every pixel is at most "255 255 255 "
+        *text = malloc(pixels * 12 + 1);
+        size_t len = 0;
+        for (size_t p = 0; p < pixels; p++) {
+            Pixel px = r->image[p];
+            len += sprintf(*text + len, "%i %i %i ", px.red, px.green, px.blue);
+        }
+        iov[1].iov_base = *text;
+        iov[1].iov_len = len;
+    } else if (format == FORMAT_PFM) {
+        iov[1].iov_base = r->hdr;
+        iov[1].iov_len = pixels * 3 * sizeof(float);
+    } else {
+        iov[1].iov_base = r->image;
+        iov[1].iov_len = pixels * sizeof(Pixel);
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = image_header(r, format, header);
+}
+
+// write the finished image with a single vectored write of header and data
+void write_image(Render* r, char* path, int format) {
+    char header[128];
+    struct iovec iov[2];
+    char* text;
+    image_iov(r, format, header, iov, &text);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open output file \"%s\"\n", path);
+        exit(1);
+    }
+    if (write_all(fd, iov, 2) != 0 || close(fd) != 0) {
+        fprintf(stderr, "Error: Could not write output file \"%s\"\n", path);
+        exit(1);
+    }
+    free(text);
+}
+
+// streaming renders keep two bands of rows in memory instead of the whole
+// image: the render thread traces one band while a writer thread writes
+// the one before it, so tracing and disk writes overlap and memory stays
+// the same however tall the image is
+#define STREAM_BAND_ROWS (4 * TILE_SIZE)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    Render bands[2];
+    int full[2];      // the band is rendered and waiting for the writer
+    int band_count;
+    int fd;
+    int format;
+    off_t header_size;
+    int failed;
+} Stream;
+
+// writer thread, write the bands out in order as they fill
+void* stream_writer(void* arg) {
+    Stream* st = arg;
+    for (int b = 0; b < st->band_count; b++) {
+        int k = b % 2;
+        pthread_mutex_lock(&st->lock);
+        while (!st->full[k]) {
+            pthread_cond_wait(&st->changed, &st->lock);
+        }
+        pthread_mutex_unlock(&st->lock);
+
+        Render* band = &st->bands[k];
+        char header[128];
+        struct iovec iov[2];
+        char* text;
+        image_iov(band, st->format, header, iov, &text);
+        if (st->format == FORMAT_PFM) {
+            // float rows run bottom first, so a band lands below the ones
+            // above it in the image
+            off_t row = band->height - band->top - band->rows;
+            off_t at = st->header_size + row * band->width * 3 * (off_t)sizeof(float);
+            if (lseek(st->fd, at, SEEK_SET) < 0) {
+                st->failed = 1;
+            }
+        }
+        if (!st->failed && write_all(st->fd, iov + 1, 1) != 0) {
+            st->failed = 1;
+        }
+        free(text);
+
+        pthread_mutex_lock(&st->lock);
+        st->full[k] = 0;
+        pthread_cond_signal(&st->changed);
+        pthread_mutex_unlock(&st->lock);
+    }
+    return NULL;
+}
+
+// render the image a band at a time into path. bands are crops, so with
+// antialiasing each traces a row above and below for edge detection and
+// the result is the same as rendering the whole image at once
+void render_stream(Render* settings, int threads, char* path, int format) {
+    Stream st;
+    int width = settings->width;
+    int height = settings->height;
+    int rows = height < STREAM_BAND_ROWS ? height : STREAM_BAND_ROWS;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.changed, NULL);
+    st.band_count = (height + STREAM_BAND_ROWS - 1) / STREAM_BAND_ROWS;
+    st.format = format;
+    st.failed = 0;
+    for (int k = 0; k < 2; k++) {
+        Render* band = &st.bands[k];
+        render_init_crop(band, width, height, 0, 0, width, rows, format == FORMAT_PFM);
+        band->timing = settings->timing;
+        band->aa = settings->aa;
+        band->light_cutoff = settings->light_cutoff;
+        band->light_samples = settings->light_samples;
+        band->raster = settings->raster;
+        band->shared_index = 1;
+        st.full[k] = 0;
+    }
+    // one light index and set of bins serves every band
+    render_index(&st.bands[0]);
+    st.bands[1].lights = st.bands[0].lights;
+    st.bands[1].bins = st.bands[0].bins;
+
+    st.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (st.fd < 0) {
+        fprintf(stderr, "Error: Could not open output file \"%s\"\n", path);
+        exit(1);
+    }
+    char header[128];
+    Render whole = *settings;
+    whole.left = 0;
+    whole.top = 0;
+    whole.cols = width;
+    whole.rows = height;
+    struct iovec iov = {header, image_header(&whole, format, header)};
+    st.header_size = iov.iov_len;
+    if (write_all(st.fd, &iov, 1) != 0) {
+        fprintf(stderr, "Error: Could not write output file \"%s\"\n", path);
+        exit(1);
+    }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, stream_writer, &st) != 0) {
+        fprintf(stderr, "Error: Could not start writer thread.\n");
+        exit(1);
+    }
+
+    for (int b = 0; b < st.band_count; b++) {
+        int k = b % 2;
+        Render* band = &st.bands[k];
+        // wait for the writer to be done with what this buffer held
+        pthread_mutex_lock(&st.lock);
+        while (st.full[k]) {
+            pthread_cond_wait(&st.changed, &st.lock);
+        }
+        pthread_mutex_unlock(&st.lock);
+        band->top = b * STREAM_BAND_ROWS;
+        band->rows = height - band->top < STREAM_BAND_ROWS ? height - band->top : STREAM_BAND_ROWS;
+        render_image(band, threads);
+        pthread_mutex_lock(&st.lock);
+        st.full[k] = 1;
+        pthread_cond_signal(&st.changed);
+        pthread_mutex_unlock(&st.lock);
+    }
+
+    pthread_join(writer, NULL);
+    if (st.failed || close(st.fd) != 0) {
+        fprintf(stderr, "Error: Could not write output file \"%s\"\n", path);
+        exit(1);
+    }
+    render_index_free(&st.bands[0]);
+    for (int k = 0; k < 2; k++) {
+        stats_merge(&settings->stats, &st.bands[k].stats);
+        render_free(&st.bands[k]);
+    }
+    pthread_cond_destroy(&st.changed);
+    pthread_mutex_destroy(&st.lock);
+}
+
+// precompiled scene cache; a versioned snapshot of the compiled scene and
+// its bvh that renders map straight into memory instead of parsing json
+#define CACHE_MAGIC "RTSCENE"
+#define CACHE_VERSION 6
+// float and double builds keep separate caches next to the same json
+#ifdef REAL_FLOAT
+#define CACHE_SUFFIX ".f32.rtc"
+#else
+#define CACHE_SUFFIX ".rtc"
+#endif
+#define CACHE_ALIGN 64
+#define CACHE_MAX_SECTIONS 32
+
+typedef struct {
+    char magic[8];
+    int version;
+    int simd_width;
+    int real_size;
+    unsigned long long source_hash;
+    double camera_width;
+    double camera_height;
+    int sphere_count;
+    int plane_count;
+    int material_count;
+    int light_count;
+    int bvh_node_count;
+    int mesh_vertex_count;
+    int triangle_count;
+    int triangle_node_count;
+    unsigned long long mesh_files_size;
+    unsigned long long mesh_hash;  // of the mesh files, which source_hash doesn't cover
+    int section_count;
+    unsigned long long offset[CACHE_MAX_SECTIONS];
+} CacheHeader;
+
+// mapping the scene was loaded from, if any
+void* scene_mapping = NULL;
+size_t scene_mapping_size = 0;
+
+// mix a block of memory into a 64 bit hash a word at a time
+unsigned long long hash_bytes(unsigned long long hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// 64 bit hash of a whole file; used only to notice that the json behind a
+// cache has changed
+unsigned long long hash_file(char* filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+        exit(1);
+    }
+    unsigned long long hash = 0x9e3779b97f4a7c15ULL ^ (unsigned long long)info.st_size;
+    if (info.st_size > 0) {
+        unsigned char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not map file \"%s\"\n", filename);
+            exit(1);
+        }
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+        hash = hash_bytes(hash, data, info.st_size);
+        munmap(data, info.st_size);
+    }
+    close(fd);
+    return hash;
+}
+
+// every array of the compiled scene, in the order they sit in a cache file
+int cache_sections(void** field[], size_t size[]) {
+    int n = 0;
+    size_t spheres = scene.sphere_count + SIMD_WIDTH;
+    size_t planes = scene.plane_count + SIMD_WIDTH;
+    for (int k = 0; k < 3; k++) {
+        field[n] = (void**)&scene.sphere_center[k];
+        size[n++] = sizeof(real)*spheres;
+    }
+    field[n] = (void**)&scene.sphere_r2;
+    size[n++] = sizeof(real)*spheres;
+    field[n] = (void**)&scene.sphere_material;
+    size[n++] = sizeof(int)*spheres;
+    field[n] = (void**)&scene.sphere_slot;
+    size[n++] = sizeof(int)*spheres;
+    for (int k = 0; k < 3; k++) {
+        field[n] = (void**)&scene.plane_point[k];
+        size[n++] = sizeof(real)*planes;
+        field[n] = (void**)&scene.plane_normal[k];
+        size[n++] = sizeof(real)*planes;
+    }
+    field[n] = (void**)&scene.plane_material;
+    size[n++] = sizeof(int)*planes;
+    field[n] = (void**)&scene.materials;
+    size[n++] = sizeof(Material)*(scene.material_count + 1);
+    field[n] = (void**)&scene.lights;
+    size[n++] = sizeof(Light)*(scene.light_count + 1);
+    field[n] = (void**)&bvh_nodes;
+    size[n++] = sizeof(BVHNode)*(bvh_node_count + 1);
+    field[n] = (void**)&scene.mesh_vertex;
+    size[n++] = sizeof(real)*3*((size_t)scene.mesh_vertex_count + 1);
+    field[n] = (void**)&scene.triangle_vertex;
+    size[n++] = sizeof(int)*3*((size_t)scene.triangle_count + SIMD_WIDTH);
+    field[n] = (void**)&scene.triangle_material;
+    size[n++] = sizeof(int)*((size_t)scene.triangle_count + SIMD_WIDTH);
+    field[n] = (void**)&scene.triangle_nodes;
+    size[n++] = sizeof(BVHNode)*(scene.triangle_node_count + 1);
+    field[n] = (void**)&scene.mesh_files;
+    size[n++] = scene.mesh_files_size + 1;
+    return n;
+}
+
+// hash of every mesh file the scene was compiled from, 0 if one is missing
+unsigned long long mesh_files_hash() {
+    unsigned long long hash = 0;
+    char* end = scene.mesh_files + scene.mesh_files_size;
+    for (char* name = scene.mesh_files; name < end; name += strlen(name) + 1) {
+        if (access(name, R_OK) != 0) {
+            return 0;
+        }
+        hash = (hash ^ hash_file(name)) * 0x100000001b3ULL + 1;
+    }
+    return hash;
+}
+
+// write the compiled scene and bvh to a cache file
+void write_scene_cache(char* path, unsigned long long source_hash) {
+    static char zeros[CACHE_ALIGN];
+    void** field[CACHE_MAX_SECTIONS];
+    size_t size[CACHE_MAX_SECTIONS];
+    struct iovec iov[2*CACHE_MAX_SECTIONS + 1];
+    CacheHeader header;
+    int count = cache_sections(field, size);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.simd_width = SIMD_WIDTH;
+    header.real_size = sizeof(real);
+    header.source_hash = source_hash;
+    header.camera_width = scene.camera_width;
+    header.camera_height = scene.camera_height;
+    header.sphere_count = scene.sphere_count;
+    header.plane_count = scene.plane_count;
+    header.material_count = scene.material_count;
+    header.light_count = scene.light_count;
+    header.bvh_node_count = bvh_node_count;
+    header.mesh_vertex_count = scene.mesh_vertex_count;
+    header.triangle_count = scene.triangle_count;
+    header.triangle_node_count = scene.triangle_node_count;
+    header.mesh_files_size = scene.mesh_files_size;
+    header.mesh_hash = mesh_files_hash();
+    header.section_count = count;
+
+    // each section starts on a CACHE_ALIGN boundary so it can be used in place
+    int n = 1;
+    size_t offset = (sizeof(CacheHeader) + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(CacheHeader);
+    iov[n].iov_base = zeros;
+    iov[n++].iov_len = offset - sizeof(CacheHeader);
+    for (int s = 0; s < count; s++) {
+        size_t padded = (size[s] + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+        header.offset[s] = offset;
+        iov[n].iov_base = *field[s] != NULL ? *field[s] : zeros;
+        iov[n++].iov_len = *field[s] != NULL ? size[s] : 0;
+        iov[n].iov_base = zeros;
+        iov[n++].iov_len = padded - (*field[s] != NULL ? size[s] : 0);
+        offset += padded;
+    }
+
+    // written under a temporary name and renamed so readers never see half a file
+    char temp[4096];
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, iov, n) != 0 || close(fd) != 0 || rename(temp, path) != 0) {
+        fprintf(stderr, "Error: Could not write scene cache \"%s\"\n", path);
+        unlink(temp);
+        exit(1);
+    }
+}
+
+// map a cache file and point the scene at it; returns 0 if the file is
+// missing, from another version or built from different json
+int load_scene_cache(char* path, unsigned long long source_hash) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return 0;
+    }
+    // private writable mapping, so in-memory edits to the scene never
+    // reach the file
+    void* map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    CacheHeader* header = map;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header->version != CACHE_VERSION ||
+        header->simd_width != SIMD_WIDTH ||
+        header->real_size != sizeof(real) ||
+        header->source_hash != source_hash) {
+        munmap(map, info.st_size);
+        return 0;
+    }
+
+    scene.camera_width = header->camera_width;
+    scene.camera_height = header->camera_height;
+    scene.sphere_count = header->sphere_count;
+    scene.plane_count = header->plane_count;
+    scene.material_count = header->material_count;
+    scene.light_count = header->light_count;
+    bvh_node_count = header->bvh_node_count;
+    scene.mesh_vertex_count = header->mesh_vertex_count;
+    scene.triangle_count = header->triangle_count;
+    scene.triangle_node_count = header->triangle_node_count;
+    scene.mesh_files_size = header->mesh_files_size;
+
+    void** field[CACHE_MAX_SECTIONS];
+    size_t size[CACHE_MAX_SECTIONS];
+    int count = cache_sections(field, size);
+    if (count != header->section_count) {
+        munmap(map, info.st_size);
+        return 0;
+    }
+    for (int s = 0; s < count; s++) {
+        if (header->offset[s] + size[s] > (size_t)info.st_size) {
+            fprintf(stderr, "Error: Scene cache \"%s\" is truncated.\n", path);
+            exit(1);
+        }
+        *field[s] = (char*)map + header->offset[s];
+    }
+    // a mesh file edited since the cache was written makes it stale too
+    if (mesh_files_hash() != header->mesh_hash) {
+        munmap(map, info.st_size);
+        return 0;
+    }
+    scene_mapping = map;
+    scene_mapping_size = info.st_size;
+    return 1;
+}
+
+// parse and compile a json scene into memory
+void parse_scene(char* filename) {
+    double start = now_seconds();
+    read_scene(filename);
+    double parsed = now_seconds();
+    collect_lights();
+    compile_scene();
+    build_bvh();
+    build_triangle_bvh();
+    arena_release(&parse_arena);
+    memset(&objects, 0, sizeof(objects));
+    phase_seconds[PHASE_PARSE] += parsed - start;
+    phase_seconds[PHASE_SETUP] += now_seconds() - parsed;
+}
+
+// load a scene, going through its cache file (filename.rtc, or filename.f32.rtc
+// in float builds) when one exists
+// and was built from the same json; a stale cache is rebuilt
+void load_scene(char* filename, int use_cache) {
+    char path[4096];
+    if (!use_cache) {
+        parse_scene(filename);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s" CACHE_SUFFIX, filename);
+    if (access(path, F_OK) != 0) {
+        parse_scene(filename);
+        return;
+    }
+    double start = now_seconds();
+    unsigned long long hash = hash_file(filename);
+    if (load_scene_cache(path, hash)) {
+        phase_seconds[PHASE_SETUP] += now_seconds() - start;
+        return;
+    }
+    fprintf(stderr, "Note: Scene cache \"%s\" is out of date, rebuilding it.\n", path);
+    parse_scene(filename);
+    write_scene_cache(path, hash);
+}
+
+// compile mode, parse a json scene and save it as a cache for later renders
+int compile_main(int argc, char** argv) {
+    char path[4096];
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: raytracer compile input.json [output.rtc]\n");
+        return 1;
+    }
+    if (argc == 4) {
+        snprintf(path, sizeof(path), "%s", argv[3]);
+    } else {
+        snprintf(path, sizeof(path), "%s" CACHE_SUFFIX, argv[2]);
+    }
+    unsigned long long hash = hash_file(argv[2]);
+    parse_scene(argv[2]);
+    write_scene_cache(path, hash);
+    arena_release(&scene_arena);
+    if (scene_mapping != NULL) {
+        munmap(scene_mapping, scene_mapping_size);
+    }
+    return 0;
+}
+
+// mesh mode, convert an obj file to a binary mesh, which loads without
+// parsing any text
+int mesh_main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: raytracer mesh input.obj output.mesh\n");
+        return 1;
+    }
+    int vertices;
+    int triangles;
+    read_mesh(argv[2], NULL, NULL, &vertices, &triangles);
+    real* vertex = malloc(sizeof(real)*3*((size_t)vertices + 1));
+    int* triangle = malloc(sizeof(int)*3*((size_t)triangles + 1));
+    float* v = malloc(sizeof(float)*3*((size_t)vertices + 1));
+    if (vertex == NULL || triangle == NULL || v == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        exit(1);
+    }
+    read_mesh(argv[2], vertex, triangle, &vertices, &triangles);
+    for (size_t i = 0; i < 3*(size_t)vertices; i++) {
+        v[i] = vertex[i];
+    }
+
+    MeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC));
+    header.vertex_count = vertices;
+    header.triangle_count = triangles;
+    struct iovec iov[3] = {
+        {&header, sizeof(header)},
+        {v, sizeof(float)*3*(size_t)vertices},
+        {triangle, sizeof(int)*3*(size_t)triangles}
+    };
+    int fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, iov, 3) != 0 || close(fd) != 0) {
+        fprintf(stderr, "Error: Could not write mesh \"%s\"\n", argv[3]);
+        exit(1);
+    }
+    fprintf(stderr, "Note: Wrote %d vertices and %d triangles to \"%s\".\n", vertices, triangles, argv[3]);
+    free(vertex);
+    free(triangle);
+    free(v);
+    return 0;
+}
+
+// point a whole image render's buffers into a checkpoint file, creating it
+// or, when one with the same key is there, resuming from it. the key covers
+// the scene json, its mesh files and every setting that changes pixels
+void checkpoint_open(Render* r, char* path, char* scene_file) {
+    int tiles_x = (r->cols + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (r->rows + TILE_SIZE - 1) / TILE_SIZE;
+    size_t pixels = (size_t)r->cols * r->rows;
+    CheckpointHeader key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    key.version = CHECKPOINT_VERSION;
+    key.real_size = sizeof(real);
+    key.source_hash = hash_file(scene_file);
+    key.mesh_hash = mesh_files_hash();
+    key.width = r->width;
+    key.height = r->height;
+    key.hdr = r->hdr != NULL;
+    key.aa = r->aa;
+    key.light_cutoff = r->light_cutoff;
+    key.light_samples = r->light_samples;
+    key.tile_count = tiles_x * tiles_y;
+
+    // header, tile flags for both passes, image, float image, then the
+    // first pass object ids and colors; each on a CACHE_ALIGN boundary
+    size_t size[5] = {
+        2 * (size_t)key.tile_count,
+        sizeof(Pixel) * pixels,
+        key.hdr ? sizeof(float) * 3 * pixels : 0,
+        key.aa > 1 ? sizeof(int) * pixels : 0,
+        key.aa > 1 ? sizeof(Pixel) * pixels : 0,
+    };
+    size_t offset[5];
+    size_t total = (sizeof(CheckpointHeader) + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+    for (int k = 0; k < 5; k++) {
+        offset[k] = total;
+        total += (size[k] + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+    }
+    key.size = total;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Error: Could not open checkpoint \"%s\"\n", path);
+        exit(1);
+    }
+    CheckpointHeader found;
+    int resume = (size_t)info.st_size == total &&
+                 pread(fd, &found, sizeof(found), 0) == sizeof(found) &&
+                 memcmp(&found, &key, offsetof(CheckpointHeader, first_saved)) == 0 &&
+                 found.size == total;
+    if (!resume) {
+        if (info.st_size > 0) {
+            fprintf(stderr, "Note: Checkpoint \"%s\" is from a different render, starting over.\n", path);
+        }
+        // zero the whole file, no tile is done yet
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, total) != 0) {
+            fprintf(stderr, "Error: Could not size checkpoint \"%s\"\n", path);
+            exit(1);
+        }
+    }
+    char* map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map checkpoint \"%s\"\n", path);
+        exit(1);
+    }
+    r->checkpoint = (CheckpointHeader*)map;
+    if (!resume) {
+        // the magic is part of the key, so a header cut short never matches
+        *r->checkpoint = key;
+    } else {
+        int done = 0;
+        for (int t = 0; t < 2 * key.tile_count; t++) {
+            done += map[offset[0] + t];
+        }
+        fprintf(stderr, "Note: Resuming from checkpoint \"%s\", %d of %d tiles done.\n",
+                path, done, (key.aa > 1 ? 2 : 1) * key.tile_count);
+    }
+    free(r->image);
+    free(r->hdr);
+    r->tiles_done = (unsigned char*)map + offset[0];
+    r->image = (Pixel*)(map + offset[1]);
+    r->hdr = key.hdr ? (float*)(map + offset[2]) : NULL;
+    r->first_id = key.aa > 1 ? (int*)(map + offset[3]) : NULL;
+    r->first_image = key.aa > 1 ? (Pixel*)(map + offset[4]) : NULL;
+}
+
+// unmap a checkpoint once its image is safely written, and delete it
+void checkpoint_close(Render* r, char* path) {
+    munmap(r->checkpoint, r->checkpoint->size);
+    unlink(path);
+    r->checkpoint = NULL;
+    r->tiles_done = NULL;
+    r->image = NULL;
+    r->hdr = NULL;
+    r->first_id = NULL;
+    r->first_image = NULL;
+}
+
+// hash of the compiled scene without its lights: camera, primitives,
+// meshes and materials. the bvhs are built from these, so they are left out
+unsigned long long scene_geometry_hash() {
+    int counts[6] = {scene.sphere_count, scene.plane_count, scene.mesh_vertex_count,
+                     scene.triangle_count, scene.material_count, (int)sizeof(real)};
+    real camera[2] = {scene.camera_width, scene.camera_height};
+    unsigned long long hash = hash_bytes(0x9e3779b97f4a7c15ULL, counts, sizeof(counts));
+    hash = hash_bytes(hash, camera, sizeof(camera));
+    for (int k = 0; k < 3; k++) {
+        hash = hash_bytes(hash, scene.sphere_center[k], sizeof(real)*scene.sphere_count);
+        hash = hash_bytes(hash, scene.plane_point[k], sizeof(real)*scene.plane_count);
+        hash = hash_bytes(hash, scene.plane_normal[k], sizeof(real)*scene.plane_count);
+    }
+    hash = hash_bytes(hash, scene.sphere_r2, sizeof(real)*scene.sphere_count);
+    hash = hash_bytes(hash, scene.sphere_material, sizeof(int)*scene.sphere_count);
+    hash = hash_bytes(hash, scene.plane_material, sizeof(int)*scene.plane_count);
+    hash = hash_bytes(hash, scene.mesh_vertex, sizeof(real)*3*(size_t)scene.mesh_vertex_count);
+    hash = hash_bytes(hash, scene.triangle_vertex, sizeof(int)*3*(size_t)scene.triangle_count);
+    hash = hash_bytes(hash, scene.triangle_material, sizeof(int)*scene.triangle_count);
+    hash = hash_bytes(hash, scene.materials, sizeof(Material)*scene.material_count);
+    return hash;
+}
+
+// what decides a g-buffer's hits and the colors it can hand back; the
+// light count isn't part of it
+void gbuffer_key(Render* r, GBufferHeader* key) {
+    memset(key, 0, sizeof(*key));
+    memcpy(key->magic, GBUFFER_MAGIC, sizeof(GBUFFER_MAGIC));
+    key->version = GBUFFER_VERSION;
+    key->real_size = sizeof(real);
+    key->geometry_hash = scene_geometry_hash();
+    key->width = r->width;
+    key->height = r->height;
+    key->light_cutoff = r->light_cutoff;
+    key->light_samples = r->light_samples;
+}
+
+// where the lights, their reach and the pixels sit in a g-buffer file,
+// each on a CACHE_ALIGN boundary; returns the file size
+size_t gbuffer_layout(int lights, size_t pixels, size_t* offset) {
+    size_t size[3] = {sizeof(Light)*lights, sizeof(double)*lights, sizeof(GBufferPixel)*pixels};
+    size_t total = (sizeof(GBufferHeader) + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+    for (int k = 0; k < 3; k++) {
+        offset[k] = total;
+        total += (size[k] + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+    }
+    return total;
+}
+
+// start recording a whole image render's first pass for --gbuffer, and map
+// the g-buffer an earlier render left at path if it has the same key
+void gbuffer_open(Render* r, char* path) {
+    GBuffer* g = calloc(1, sizeof(GBuffer));
+    size_t pixels = (size_t)r->width * r->height;
+    g->pixels = malloc(sizeof(GBufferPixel)*pixels);
+    if (g->pixels == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        exit(1);
+    }
+    r->gbuffer = g;
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(GBufferHeader)) {
+        close(fd);
+        fprintf(stderr, "Note: G-buffer \"%s\" is unreadable, rendering everything.\n", path);
+        return;
+    }
+    char* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Note: G-buffer \"%s\" is unreadable, rendering everything.\n", path);
+        return;
+    }
+    GBufferHeader key;
+    gbuffer_key(r, &key);
+    GBufferHeader* found = (GBufferHeader*)map;
+    size_t offset[3];
+    if (memcmp(found, &key, offsetof(GBufferHeader, light_count)) != 0 || found->light_count < 0 ||
+        found->size != (size_t)info.st_size ||
+        gbuffer_layout(found->light_count, pixels, offset) != found->size) {
+        fprintf(stderr, "Note: G-buffer \"%s\" is from other geometry or settings, rendering everything.\n", path);
+        munmap(map, info.st_size);
+        return;
+    }
+    g->previous = found;
+    g->previous_lights = (Light*)(map + offset[0]);
+    g->previous_radius = (double*)(map + offset[1]);
+    g->previous_pixels = (GBufferPixel*)(map + offset[2]);
+}
+
+// save the finished render's g-buffer over the old one and free both
+void gbuffer_close(Render* r, char* path) {
+    static char zeros[CACHE_ALIGN];
+    GBuffer* g = r->gbuffer;
+    size_t pixels = (size_t)r->width * r->height;
+    size_t offset[3];
+    GBufferHeader header;
+    gbuffer_key(r, &header);
+    header.light_count = scene.light_count;
+    header.size = gbuffer_layout(scene.light_count, pixels, offset);
+
+    void* field[4] = {&header, scene.lights, g->radius, g->pixels};
+    size_t start[5] = {0, offset[0], offset[1], offset[2], header.size};
+    size_t size[4] = {sizeof(header), sizeof(Light)*scene.light_count,
+                      sizeof(double)*scene.light_count, sizeof(GBufferPixel)*pixels};
+    struct iovec iov[8];
+    for (int k = 0; k < 4; k++) {
+        iov[2*k].iov_base = field[k];
+        iov[2*k].iov_len = size[k];
+        iov[2*k + 1].iov_base = zeros;
+        iov[2*k + 1].iov_len = start[k + 1] - start[k] - size[k];
+    }
+    // renamed into place, the old file stays mapped until then
+    char temp[4096];
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, iov, 8) != 0 || close(fd) != 0 || rename(temp, path) != 0) {
+        fprintf(stderr, "Error: Could not write g-buffer \"%s\"\n", path);
+        unlink(temp);
+        exit(1);
+    }
+    if (g->previous != NULL) {
+        munmap(g->previous, g->previous->size);
+    }
+    free(g->pixels);
+    free(g->radius);
+    free(g->changed);
+    free(g);
+    r->gbuffer = NULL;
+}
+
+// small deterministic generator so benchmark scenes are reproducible
+typedef struct {
+    unsigned long long state;
+} Random;
+
+double random_uniform(Random* rng, double low, double high) {
+    rng->state ^= rng->state << 13;
+    rng->state ^= rng->state >> 7;
+    rng->state ^= rng->state << 17;
+    return low + (high - low) * ((rng->state >> 11) * (1.0 / 9007199254740992.0));
+}
+
+// write a procedural scene in the json scene format. spheres fill a box in
+// front of the camera that grows with their count so density stays about
+// the same; planes are a floor, a back wall and then side walls; lights
+// alternate between point lights and downward facing spot lights
+void generate_scene(char* path, int spheres, int planes, int lights, unsigned long long seed) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Could not open output file \"%s\"\n", path);
+        exit(1);
+    }
+    Random rng = {seed * 2654435761ULL + 88172645463325252ULL};
+    double extent = 2 * cbrt(spheres > 0 ? spheres : 1);
+    double radius = 0.6 * extent / cbrt(spheres > 0 ? spheres : 1) / 2;
+    double plane_points[][3] = {{0, -extent, 0}, {0, 0, 4 + 3*extent}, {-2*extent, 0, 0}, {2*extent, 0, 0}, {0, 2*extent, 0}};
+    double plane_normals[][3] = {{0, 1, 0}, {0, 0, -1}, {1, 0, 0}, {-1, 0, 0}, {0, -1, 0}};
+
+    fprintf(out, "[\n {\"type\": \"camera\", \"width\": 2.0, \"height\": 1.5}");
+    for (int i = 0; i < spheres; i++) {
+        fprintf(out, ",\n {\"type\": \"sphere\", \"radius\": %.4f, "
+                "\"diffuse_color\": [%.3f, %.3f, %.3f], \"specular_color\": [%.3f, %.3f, %.3f], "
+                "\"position\": [%.4f, %.4f, %.4f]}",
+                random_uniform(&rng, 0.3, 1) * radius,
+                random_uniform(&rng, 0, 1), random_uniform(&rng, 0, 1), random_uniform(&rng, 0, 1),
+                random_uniform(&rng, 0, 0.5), random_uniform(&rng, 0, 0.5), random_uniform(&rng, 0, 0.5),
+                random_uniform(&rng, -extent, extent), random_uniform(&rng, -extent, extent),
+                random_uniform(&rng, 2 + extent, 2 + 3*extent));
+    }
+    for (int i = 0; i < planes; i++) {
+        int p = i % 5;
+        fprintf(out, ",\n {\"type\": \"plane\", \"diffuse_color\": [%.3f, %.3f, %.3f], "
+                "\"specular_color\": [0, 0, 0], \"position\": [%g, %g, %g], \"normal\": [%g, %g, %g]}",
+                random_uniform(&rng, 0.2, 0.6), random_uniform(&rng, 0.2, 0.6), random_uniform(&rng, 0.2, 0.6),
+                plane_points[p][0], plane_points[p][1], plane_points[p][2] + (i / 5),
+                plane_normals[p][0], plane_normals[p][1], plane_normals[p][2]);
+    }
+    for (int i = 0; i < lights; i++) {
+        double color = 1.0 / (lights > 4 ? lights / 4.0 : 1);
+        fprintf(out, ",\n {\"type\": \"light\", \"color\": [%.3f, %.3f, %.3f], ",
+                color * random_uniform(&rng, 0.5, 1), color * random_uniform(&rng, 0.5, 1),
+                color * random_uniform(&rng, 0.5, 1));
+        if (i % 2 == 0) {
+            fprintf(out, "\"theta\": 0, ");
+        } else {
+            fprintf(out, "\"theta\": %.1f, \"angular-a0\": 2, \"direction\": [0, -1, %.3f], ",
+                    random_uniform(&rng, 30, 90), random_uniform(&rng, -0.3, 0.3));
+        }
+        fprintf(out, "\"radial-a2\": %.4f, \"radial-a1\": 0.05, \"radial-a0\": 1, "
+                "\"position\": [%.4f, %.4f, %.4f]}",
+                0.1 / (extent * extent),
+                random_uniform(&rng, -extent, extent), random_uniform(&rng, extent, 2*extent),
+                random_uniform(&rng, 0, 2 + 2*extent));
+    }
+    fprintf(out, "\n]\n");
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: Could not write output file \"%s\"\n", path);
+        exit(1);
+    }
+}
+
+// generate mode, write a procedural scene to a json file
+int generate_main(int argc, char** argv) {
+    if (argc < 6 || argc > 7) {
+        fprintf(stderr, "Usage: raytracer generate spheres planes lights output.json [seed]\n");
+        return 1;
+    }
+    generate_scene(argv[5], atoi(argv[2]), atoi(argv[3]), atoi(argv[4]),
+                   argc == 7 ? strtoull(argv[6], NULL, 10) : 1);
+    return 0;
+}
+
+// one benchmark scene size
+typedef struct {
+    int spheres;
+    int planes;
+    int lights;
+} BenchCase;
+
+// measurements a benchmark child sends back to its parent
+typedef struct {
+    double load_seconds;
+    double render_seconds;
+    long long primary_rays;
+    long long shadow_rays;
+} BenchResult;
+
+// bench mode; every case runs in a forked child so its peak resident size
+// is measured on its own. results go to stdout as one json object per line
+int bench_main(int argc, char** argv) {
+    BenchCase cases[] = {
+        {10, 1, 1},
+        {100, 2, 2},
+        {1000, 2, 4},
+        {10000, 3, 8},
+        {100000, 3, 16},
+    };
+    int case_count = sizeof(cases) / sizeof(cases[0]);
+    int width = 640;
+    int height = 480;
+    int threads = 1;
+    int repeat = 1;
+
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            threads = atoi(argv[++a]);
+            if (threads <= 0) {
+                threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (strcmp(argv[a], "--size") == 0 && a + 1 < argc) {
+            if (sscanf(argv[++a], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                fprintf(stderr, "Error: Expected --size WIDTHxHEIGHT.\n");
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--cases") == 0 && a + 1 < argc) {
+            case_count = atoi(argv[++a]);
+            if (case_count < 1 || case_count > (int)(sizeof(cases) / sizeof(cases[0]))) {
+                fprintf(stderr, "Error: --cases must be between 1 and %d.\n",
+                        (int)(sizeof(cases) / sizeof(cases[0])));
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--repeat") == 0 && a + 1 < argc) {
+            repeat = atoi(argv[++a]);
+            if (repeat < 1) repeat = 1;
+        } else {
+            fprintf(stderr, "Usage: raytracer bench [--threads N] [--size WxH] [--cases N] [--repeat N]\n");
+            return 1;
+        }
+    }
+
+    char dir[] = "/tmp/raytracer-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "Error: Could not create a temporary directory.\n");
+        return 1;
+    }
+    for (int c = 0; c < case_count; c++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/scene-%d.json", dir, c);
+        generate_scene(path, cases[c].spheres, cases[c].planes, cases[c].lights, c + 1);
+
+        for (int run = 0; run < repeat; run++) {
+            int fds[2];
+            if (pipe(fds) != 0) {
+                fprintf(stderr, "Error: Could not create a pipe.\n");
+                return 1;
+            }
+            double start = now_seconds();
+            pid_t pid = fork();
+            if (pid < 0) {
+                fprintf(stderr, "Error: Could not fork.\n");
+                return 1;
+            }
+            if (pid == 0) {
+                BenchResult result;
+                Render render;
+                close(fds[0]);
+                double t0 = now_seconds();
+                parse_scene(path);
+                double t1 = now_seconds();
+                render_init(&render, width, height, 0);
+                render_image(&render, threads);
+                double t2 = now_seconds();
+                result.load_seconds = t1 - t0;
+                result.render_seconds = t2 - t1;
+                result.primary_rays = (long long)width * height;
+                result.shadow_rays = render.stats.shadow_rays;
+                if (write(fds[1], &result, sizeof(result)) != sizeof(result)) {
+                    _exit(1);
+                }
+                _exit(0);
+            }
+
+            BenchResult result;
+            struct rusage usage;
+            int status;
+            close(fds[1]);
+            ssize_t got = read(fds[0], &result, sizeof(result));
+            close(fds[0]);
+            wait4(pid, &status, 0, &usage);
+            double wall = now_seconds() - start;
+            if (got != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Error: Benchmark case %d failed.\n", c);
+                return 1;
+            }
+            printf("{\"case\": %d, \"run\": %d, \"spheres\": %d, \"planes\": %d, \"lights\": %d, "
+                   "\"width\": %d, \"height\": %d, \"threads\": %d, "
+                   "\"load_s\": %.6f, \"render_s\": %.6f, \"wall_s\": %.6f, "
+                   "\"primary_rays\": %lld, \"shadow_rays\": %lld, "
+                   "\"primary_mrays_per_s\": %.3f, \"shadow_mrays_per_s\": %.3f, "
+                   "\"total_mrays_per_s\": %.3f, \"peak_rss_kb\": %ld}\n",
+                   c, run, cases[c].spheres, cases[c].planes, cases[c].lights,
+                   width, height, threads,
+                   result.load_seconds, result.render_seconds, wall,
+                   result.primary_rays, result.shadow_rays,
+                   result.primary_rays / result.render_seconds / 1e6,
+                   result.shadow_rays / result.render_seconds / 1e6,
+                   (result.primary_rays + result.shadow_rays) / result.render_seconds / 1e6,
+                   usage.ru_maxrss);
+            fflush(stdout);
+        }
+        unlink(path);
+    }
+    rmdir(dir);
+    return 0;
+}
+
+// read the next number of a ppm header, skipping comments. a region
+// comment written for FORMAT_PART is copied into region when it isn't NULL
+int ppm_number(FILE* in, int* value, int* region) {
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        if (c == '#') {
+            char line[256];
+            if (fgets(line, sizeof(line), in) == NULL) {
+                return 0;
+            }
+            if (region != NULL) {
+                sscanf(line, " region %d %d %d %d %d %d", &region[0], &region[1],
+                       &region[2], &region[3], &region[4], &region[5]);
+            }
+        } else if (!isspace(c)) {
+            ungetc(c, in);
+            return fscanf(in, "%d", value) == 1;
+        }
+    }
+    return 0;
+}
+
+// read a p6 or p3 image with 8 bit channels into memory, 3 bytes a pixel.
+// region (width height x0 y0 x1 y1) is left alone unless the image is a part
+unsigned char* read_ppm(char* filename, int* width, int* height, int* region) {
+    FILE* in = fopen(filename, "rb");
+    char magic[3] = {0};
+    int maxval = 0;
+    if (in == NULL) {
+        fprintf(stderr, "Error: Could not open image \"%s\"\n", filename);
+        exit(1);
+    }
+    if (fscanf(in, "%2s", magic) != 1 || !ppm_number(in, width, region) ||
+        !ppm_number(in, height, region) || !ppm_number(in, &maxval, region) ||
+        (strcmp(magic, "P6") != 0 && strcmp(magic, "P3") != 0) ||
+        *width <= 0 || *height <= 0 || maxval != 255) {
+        fprintf(stderr, "Error: \"%s\" is not an 8 bit P6 or P3 image.\n", filename);
+        exit(1);
+    }
+    size_t size = (size_t)*width * *height * 3;
+    unsigned char* data = malloc(size);
+    int ok = 1;
+    if (magic[1] == '6') {
+        fgetc(in);  // the single whitespace byte after the header
+        ok = fread(data, 1, size, in) == size;
+    } else {
+        for (size_t i = 0; i < size && ok; i++) {
+            int v;
+            ok = fscanf(in, "%d", &v) == 1 && v >= 0 && v <= 255;
+            data[i] = (unsigned char)v;
+        }
+    }
+    fclose(in);
+    if (!ok) {
+        fprintf(stderr, "Error: Image \"%s\" is truncated.\n", filename);
+        exit(1);
+    }
+    return data;
+}
+
+// compare mode; reports how far two renders of the same scene are apart,
+// e.g. a float and a double build, and fails when more than a fraction of
+// the channels differ by more than the tolerance. silhouettes can flip a
+// pixel between precisions, so the fraction allows for a few of those
+int compare_main(int argc, char** argv) {
+    if (argc < 4 || argc > 6) {
+        fprintf(stderr, "Usage: raytracer compare a.ppm b.ppm [tolerance [fraction]]\n");
+        return 1;
+    }
+    int tolerance = argc >= 5 ? atoi(argv[4]) : 0;
+    double fraction = argc == 6 ? atof(argv[5]) : 0;
+    int aw, ah, bw, bh;
+    unsigned char* a = read_ppm(argv[2], &aw, &ah, NULL);
+    unsigned char* b = read_ppm(argv[3], &bw, &bh, NULL);
+    if (aw != bw || ah != bh) {
+        fprintf(stderr, "Error: Images are %dx%d and %dx%d.\n", aw, ah, bw, bh);
+        return 1;
+    }
+    size_t size = (size_t)aw * ah * 3;
+    int max = 0;
+    double sum = 0;
+    size_t over = 0;
+    for (size_t i = 0; i < size; i++) {
+        int d = abs(a[i] - b[i]);
+        if (d > max) max = d;
+        if (d > tolerance) over++;
+        sum += d;
+    }
+    printf("{\"max_diff\": %d, \"mean_diff\": %.6f, \"over_tolerance\": %.6f, \"tolerance\": %d}\n",
+           max, sum / size, (double)over / size, tolerance);
+    free(a);
+    free(b);
+    return (double)over / size > fraction;
+}
+
+// put the parts of an image written with --region together into one image.
+// every pixel must come from exactly one part
+void merge_parts(char* output, int format, char** parts, int count) {
+    Render r;
+    unsigned char* covered = NULL;
+    for (int i = 0; i < count; i++) {
+        int region[6] = {-1, -1, -1, -1, -1, -1};
+        int cols, rows;
+        unsigned char* data = read_ppm(parts[i], &cols, &rows, region);
+        int width = region[0], height = region[1];
+        int x0 = region[2], y0 = region[3], x1 = region[4], y1 = region[5];
+        if (width <= 0 || height <= 0 || x0 < 0 || y0 < 0 || x1 > width || y1 > height ||
+            x1 - x0 != cols || y1 - y0 != rows) {
+            fprintf(stderr, "Error: \"%s\" is not a part written with --region.\n", parts[i]);
+            exit(1);
+        }
+        if (covered == NULL) {
+            render_init(&r, width, height, 0);
+            covered = calloc((size_t)width * height, 1);
+        } else if (width != r.width || height != r.height) {
+            fprintf(stderr, "Error: \"%s\" is part of a %dx%d image, not %dx%d.\n",
+                    parts[i], width, height, r.width, r.height);
+            exit(1);
+        }
+        for (int row = y0; row < y1; row++) {
+            for (int x = x0; x < x1; x++) {
+                size_t p = (size_t)row * width + x;
+                if (covered[p]) {
+                    fprintf(stderr, "Error: \"%s\" overlaps another part at %d, %d.\n", parts[i], x, row);
+                    exit(1);
+                }
+                covered[p] = 1;
+            }
+            memcpy(&r.image[(size_t)row * width + x0], &data[(size_t)(row - y0) * cols * 3],
+                   sizeof(Pixel)*cols);
+        }
+        free(data);
+    }
+    size_t missing = 0;
+    for (size_t p = 0; p < (size_t)r.width * r.height; p++) {
+        missing += !covered[p];
+    }
+    if (missing > 0) {
+        fprintf(stderr, "Error: The parts leave %zu pixels uncovered.\n", missing);
+        exit(1);
+    }
+    write_image(&r, output, format);
+    render_free(&r);
+    free(covered);
+}
+
+// merge mode, write the image a set of parts make up
+int merge_main(int argc, char** argv) {
+    char* format_name = NULL;
+    int a = 2;
+    if (a + 1 < argc && strcmp(argv[a], "--format") == 0) {
+        format_name = argv[a + 1];
+        a += 2;
+    }
+    if (argc - a < 2) {
+        fprintf(stderr, "Usage: raytracer merge [--format p6|p3] output.ppm part.ppm...\n");
+        return 1;
+    }
+    int format = image_format(format_name, argv[a]);
+    if (format == FORMAT_PFM) {
+        fprintf(stderr, "Error: Parts hold 8 bit colors and can't be merged into a pfm.\n");
+        return 1;
+    }
+    merge_parts(argv[a], format, argv + a + 1, argc - a - 1);
+    return 0;
+}
+
+// print the counters and phase timings of a finished render as json
+void print_stats(FILE* out, Render* r, int threads) {
+    Stats* s = &r->stats;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n  \"threads\": %d,\n", r->width, r->height, threads);
+    fprintf(out, "  \"scene\": {\"spheres\": %d, \"planes\": %d, \"triangles\": %d, \"lights\": %d, "
+            "\"bvh_nodes\": %d, \"triangle_bvh_nodes\": %d},\n",
+            scene.sphere_count, scene.plane_count, scene.triangle_count, scene.light_count,
+            bvh_node_count, scene.triangle_node_count);
+    fprintf(out, "  \"phases\": {\"parse_s\": %.6f, \"setup_s\": %.6f, \"render_s\": %.6f, "
+            "\"trace_thread_s\": %.6f, \"shade_thread_s\": %.6f, \"write_s\": %.6f},\n",
+            phase_seconds[PHASE_PARSE], phase_seconds[PHASE_SETUP], phase_seconds[PHASE_RENDER],
+            s->trace_seconds, s->shade_seconds, phase_seconds[PHASE_WRITE]);
+    if (r->deadline > 0) {
+        fprintf(out, "  \"refinement\": {\"level\": %d, \"levels\": %d, \"next_level_tiles\": %d},\n",
+                r->level, render_level_count(r), r->level < render_level_count(r) ? r->level_tiles : 0);
+    }
+    if (!STATS_ENABLED) {
+        fprintf(out, "  \"counters\": null\n}\n");
+        return;
+    }
+    fprintf(out, "  \"counters\": {\n");
+    fprintf(out, "    \"primary_rays\": %lld,\n", s->primary_rays);
+    fprintf(out, "    \"shadow_rays\": %lld,\n", s->shadow_rays);
+    fprintf(out, "    \"box_tests\": %lld,\n", s->box_tests);
+    fprintf(out, "    \"sphere_tests\": %lld,\n", s->sphere_tests);
+    fprintf(out, "    \"plane_tests\": %lld,\n", s->plane_tests);
+    fprintf(out, "    \"triangle_tests\": %lld,\n", s->triangle_tests);
+    fprintf(out, "    \"occluded\": %lld,\n", s->occluded);
+    fprintf(out, "    \"lit\": %lld,\n", s->lit);
+    fprintf(out, "    \"occluder_cache_hits\": %lld,\n", s->occluder_cache_hits);
+    fprintf(out, "    \"antialiased_pixels\": %lld,\n", s->antialiased_pixels);
+    fprintf(out, "    \"secondary_rays\": %lld,\n", s->secondary_rays);
+    fprintf(out, "    \"culled_lights\": %lld,\n", s->culled_lights);
+    fprintf(out, "    \"reused_pixels\": %lld,\n", s->reused_pixels);
+    fprintf(out, "    \"relit_pixels\": %lld,\n", s->relit_pixels);
+    fprintf(out, "    \"reshaded_pixels\": %lld\n", s->reshaded_pixels);
+    fprintf(out, "  }\n}\n");
+}
+
+// batch mode renders a frame list, a json array where each frame changes
+// part of the loaded scene and names the image to write:
+//   {"output": "f001.ppm", "camera": {"width": 2},
+//    "lights": [{"index": 0, "position": [0, 5, 0], "color": [1, 1, 1]}],
+//    "spheres": [{"index": 3, "position": [1, 0, 8], "radius": 0.5}],
+//    "planes": [{"index": 0, "normal": [0, 1, 0]}]}
+// indexes count objects of one kind in scene file order, and changes carry
+// over to every later frame
+
+// step to the next key of a json object, 0 once it closes
+int next_key(Parser* p, Token* key, int* first) {
+    skip_ws(p);
+    if (p->pos < p->end && *p->pos == '}') {
+        p->pos++;
+        return 0;
+    }
+    if (!*first) {
+        expect_c(p, ',');
+        skip_ws(p);
+    }
+    *first = 0;
+    *key = next_string(p);
+    skip_ws(p);
+    expect_c(p, ':');
+    skip_ws(p);
+    return 1;
+}
+
+// step to the next item of a json array, 0 once it closes
+int next_item(Parser* p, int* first) {
+    skip_ws(p);
+    if (p->pos < p->end && *p->pos == ']') {
+        p->pos++;
+        return 0;
+    }
+    if (!*first) {
+        expect_c(p, ',');
+        skip_ws(p);
+    }
+    *first = 0;
+    return 1;
+}
+
+int next_index(Parser* p, int count, char* kind) {
+    double v = next_number(p);
+    if (v != floor(v) || v < 0 || v >= count) {
+        parse_error(p, "Scene has no %s with index %g", kind, v);
+    }
+    return (int)v;
+}
+
+void read_light_change(Parser* p) {
+    Token key;
+    int first = 1;
+    int index = -1;
+    double position[3], color[3], direction[3];
+    int has_position = 0, has_color = 0, has_direction = 0;
+    expect_c(p, '{');
+    while (next_key(p, &key, &first)) {
+        if (TOKEN_IS(key, "index")) {
+            index = next_index(p, scene.light_count, "light");
+        } else if (TOKEN_IS(key, "position")) {
+            next_vector(p, position);
+            has_position = 1;
+        } else if (TOKEN_IS(key, "color")) {
+            next_vector(p, color);
+            has_color = 1;
+        } else if (TOKEN_IS(key, "direction")) {
+            next_vector(p, direction);
+            has_direction = 1;
+        } else {
+            parse_error(p, "Unknown light property \"%.*s\"", key.length, key.start);
+        }
+    }
+    if (index < 0) {
+        parse_error(p, "Light change has no index");
+    }
+    Light* l = &scene.lights[index];
+    for (int k = 0; k < 3; k++) {
+        if (has_position) l->position[k] = position[k];
+        if (has_color) l->color[k] = color[k];
+        if (has_direction) l->direction[k] = direction[k];
+    }
+    bake_light(l);
+}
+
+void read_sphere_change(Parser* p) {
+    Token key;
+    int first = 1;
+    int index = -1;
+    double position[3], radius = 0;
+    int has_position = 0, has_radius = 0;
+    expect_c(p, '{');
+    while (next_key(p, &key, &first)) {
+        if (TOKEN_IS(key, "index")) {
+            index = next_index(p, scene.sphere_count, "sphere");
+        } else if (TOKEN_IS(key, "position")) {
+            next_vector(p, position);
+            has_position = 1;
+        } else if (TOKEN_IS(key, "radius")) {
+            radius = next_number(p);
+            has_radius = 1;
+        } else {
+            parse_error(p, "Unknown sphere property \"%.*s\"", key.length, key.start);
+        }
+    }
+    if (index < 0) {
+        parse_error(p, "Sphere change has no index");
+    }
+    // spheres sit in bvh order, so find where this one went
+    int s = scene.sphere_slot[index];
+    if (has_position) {
+        for (int k = 0; k < 3; k++) {
+            scene.sphere_center[k][s] = position[k];
+        }
+    }
+    if (has_radius) {
+        scene.sphere_r2[s] = sqr(radius);
+    }
+    if (has_position || has_radius) {
+        bvh_refit(s);
+    }
+}
+
+void read_plane_change(Parser* p) {
+    Token key;
+    int first = 1;
+    int index = -1;
+    double position[3], normal[3];
+    int has_position = 0, has_normal = 0;
+    expect_c(p, '{');
+    while (next_key(p, &key, &first)) {
+        if (TOKEN_IS(key, "index")) {
+            index = next_index(p, scene.plane_count, "plane");
+        } else if (TOKEN_IS(key, "position")) {
+            next_vector(p, position);
+            has_position = 1;
+        } else if (TOKEN_IS(key, "normal")) {
+            next_vector(p, normal);
+            has_normal = 1;
+        } else {
+            parse_error(p, "Unknown plane property \"%.*s\"", key.length, key.start);
+        }
+    }
+    if (index < 0) {
+        parse_error(p, "Plane change has no index");
+    }
+    if (has_position) {
+        for (int k = 0; k < 3; k++) {
+            scene.plane_point[k][index] = position[k];
+        }
+    }
+    if (has_normal) {
+        // kept normalized like compile_scene() leaves them
+        real unit[3] = {normal[0], normal[1], normal[2]};
+        normalize(unit);
+        for (int k = 0; k < 3; k++) {
+            scene.plane_normal[k][index] = unit[k];
+        }
+    }
+}
+
+// read one frame, apply its changes to the scene and copy out its output name
+void read_frame(Parser* p, char* output, size_t size) {
+    Token key;
+    int first = 1;
+    output[0] = '\0';
+    expect_c(p, '{');
+    while (next_key(p, &key, &first)) {
+        if (TOKEN_IS(key, "output")) {
+            Token name = next_string(p);
+            if ((size_t)name.length >= size || name.length == 0) {
+                parse_error(p, "Bad output file name");
+            }
+            memcpy(output, name.start, name.length);
+            output[name.length] = '\0';
+        } else if (TOKEN_IS(key, "camera")) {
+            int inner = 1;
+            expect_c(p, '{');
+            while (next_key(p, &key, &inner)) {
+                if (TOKEN_IS(key, "width")) {
+                    scene.camera_width = next_number(p);
+                } else if (TOKEN_IS(key, "height")) {
+                    scene.camera_height = next_number(p);
+                } else {
+                    parse_error(p, "Unknown camera property \"%.*s\"", key.length, key.start);
+                }
+            }
+        } else if (TOKEN_IS(key, "lights") || TOKEN_IS(key, "spheres") || TOKEN_IS(key, "planes")) {
+            int item = 1;
+            expect_c(p, '[');
+            while (next_item(p, &item)) {
+                if (TOKEN_IS(key, "lights")) {
+                    read_light_change(p);
+                } else if (TOKEN_IS(key, "spheres")) {
+                    read_sphere_change(p);
+                } else {
+                    read_plane_change(p);
+                }
+            }
+        } else {
+            parse_error(p, "Unknown frame property \"%.*s\"", key.length, key.start);
+        }
+    }
+    if (output[0] == '\0') {
+        parse_error(p, "Frame has no output file");
+    }
+}
+
+// render every frame of a frame list back to back, keeping the scene, the
+// bvh and the image buffers between frames. with stats on, each frame
+// prints its own record, the first one including the scene load
+void render_frames(Render* r, char* filename, int threads, char* format_name, int stats) {
+    Parser parser;
+    Parser* p = &parser;
+    char output[4096];
+    int first = 1;
+    parser_open(p, filename);
+    skip_ws(p);
+    expect_c(p, '[');
+    while (next_item(p, &first)) {
+        double start = now_seconds();
+        read_frame(p, output, sizeof(output));
+        render_camera(r);
+        int format = image_format(format_name, output);
+        if (format == FORMAT_PFM && r->hdr == NULL) {
+            r->hdr = malloc(sizeof(float)*3*(size_t)r->cols*r->rows);
+        }
+        memset(&r->stats, 0, sizeof(Stats));
+        double updated = now_seconds();
+        render_image(r, threads);
+        double rendered = now_seconds();
+        write_image(r, output, format);
+        phase_seconds[PHASE_SETUP] += updated - start;
+        phase_seconds[PHASE_RENDER] += rendered - updated;
+        phase_seconds[PHASE_WRITE] += now_seconds() - rendered;
+        if (stats) {
+            print_stats(stdout, r, threads);
+        }
+        memset(phase_seconds, 0, sizeof(phase_seconds));
+    }
+    parser_close(p);
+}
+
+// server mode keeps scenes loaded and renders jobs sent over a unix domain
+// socket. a job is one line of words:
+//   render scene=scene.json width=640 height=480 crop=0,0,320,240 format=p6 aa=2
+// scene, width and height are required; crop is x0,y0,x1,y1 in pixels from
+// the top left with x1 and y1 exclusive. the reply is "ok <bytes>\n" and
+// then the image, or "error <message>\n", and a connection can send any
+// number of jobs one after another
+
+// a scene kept loaded by the server, holding what load_scene left in the
+// scene globals
+typedef struct Resident {
+    struct Resident* next;
+    char path[4096];
+    struct timespec mtime;
+    Scene scene;
+    Arena arena;
+    BVHNode* bvh_nodes;
+    int bvh_node_count;
+    void* mapping;
+    size_t mapping_size;
+} Resident;
+
+// point the scene globals at a resident scene
+void resident_install(Resident* s) {
+    scene = s->scene;
+    scene_arena = s->arena;
+    bvh_nodes = s->bvh_nodes;
+    bvh_node_count = s->bvh_node_count;
+    scene_mapping = s->mapping;
+    scene_mapping_size = s->mapping_size;
+}
+
+void resident_save(Resident* s) {
+    s->scene = scene;
+    s->arena = scene_arena;
+    s->bvh_nodes = bvh_nodes;
+    s->bvh_node_count = bvh_node_count;
+    s->mapping = scene_mapping;
+    s->mapping_size = scene_mapping_size;
+}
+
+typedef struct Job {
+    struct Job* next;
+    char* scene;
+    int width;
+    int height;
+    int crop[4];
+    int format;
+    int aa;
+    Render render;
+    char error[256];
+    int done;
+    pthread_cond_t finished;
+} Job;
+
+// jobs wait in a queue for the one thread that owns the scene globals; each
+// job is then spread over the tile workers
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Job* head;
+    Job* tail;
+    Resident* scenes;
+    int threads;
+    int use_cache;
+} Server;
+
+Server server = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+// parse errors exit, so a scene is first loaded in a child process; returns
+// 0 with the child's error message if it failed
+int scene_check(char* path, char* error, size_t size) {
+    int pipes[2];
+    if (pipe(pipes) != 0) {
+        snprintf(error, size, "Could not start scene check");
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipes[0]);
+        close(pipes[1]);
+        snprintf(error, size, "Could not start scene check");
+        return 0;
+    }
+    if (pid == 0) {
+        dup2(pipes[1], 2);
+        close(pipes[0]);
+        load_scene(path, server.use_cache);
+        _exit(0);
+    }
+    close(pipes[1]);
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(pipes[0], error + len, size - 1 - len)) > 0 && len + n < size - 1) {
+        len += n;
+    }
+    if (n > 0) len += n;
+    close(pipes[0]);
+    error[len] = '\0';
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 1;
+    }
+    // keep the first line, without the "Error: " the cli prints
+    char* end = strchr(error, '\n');
+    if (end != NULL) *end = '\0';
+    if (strncmp(error, "Error: ", 7) == 0) {
+        memmove(error, error + 7, strlen(error + 7) + 1);
+    }
+    if (error[0] == '\0') {
+        snprintf(error, size, "Could not load scene \"%s\"", path);
+    }
+    return 0;
+}
+
+// drop a resident scene and everything it holds
+void resident_free(Resident* s) {
+    resident_install(s);
+    arena_release(&scene_arena);
+    if (scene_mapping != NULL) {
+        munmap(scene_mapping, scene_mapping_size);
+    }
+    free(s);
+}
+
+// find a scene by path, loading it on first use and again whenever the
+// file has changed since; NULL with a message if it can't be loaded
+Resident* resident_get(char* path, char* error, size_t size) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        snprintf(error, size, "Could not open file \"%s\"", path);
+        return NULL;
+    }
+    Resident** link = &server.scenes;
+    while (*link != NULL) {
+        Resident* s = *link;
+        if (strcmp(s->path, path) == 0) {
+            if (s->mtime.tv_sec == info.st_mtim.tv_sec && s->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+                return s;
+            }
+            *link = s->next;
+            resident_free(s);
+            break;
+        }
+        link = &s->next;
+    }
+    if (!scene_check(path, error, size)) {
+        return NULL;
+    }
+    Resident* s = calloc(1, sizeof(Resident));
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    s->mtime = info.st_mtim;
+    resident_install(s);
+    bvh_nodes = NULL;
+    load_scene(path, server.use_cache);
+    resident_save(s);
+    s->next = server.scenes;
+    server.scenes = s;
+    return s;
+}
+
+void run_job(Job* job) {
+    Resident* s = resident_get(job->scene, job->error, sizeof(job->error));
+    if (s == NULL) {
+        return;
+    }
+    resident_install(s);
+    int* c = job->crop;
+    render_init_crop(&job->render, job->width, job->height, c[0], c[1], c[2], c[3],
+                     job->format == FORMAT_PFM);
+    job->render.aa = job->aa;
+    render_image(&job->render, server.threads);
+}
+
+// the one thread that renders, taking jobs in the order they arrived
+void* server_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&server.lock);
+        while (server.head == NULL) {
+            pthread_cond_wait(&server.ready, &server.lock);
+        }
+        Job* job = server.head;
+        server.head = job->next;
+        if (server.head == NULL) {
+            server.tail = NULL;
+        }
+        pthread_mutex_unlock(&server.lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&server.lock);
+        job->done = 1;
+        pthread_cond_signal(&job->finished);
+        pthread_mutex_unlock(&server.lock);
+    }
+    return NULL;
+}
+
+// fill in a job from a request line; 0 with a message if it is malformed
+int parse_job(char* line, Job* job, char* error, size_t size) {
+    char* save;
+    char* word = strtok_r(line, " \t\r\n", &save);
+    job->scene = NULL;
+    job->width = 0;
+    job->height = 0;
+    job->crop[0] = -1;
+    job->format = FORMAT_P6;
+    job->aa = 1;
+    if (word == NULL || strcmp(word, "render") != 0) {
+        snprintf(error, size, "Expected \"render\"");
+        return 0;
+    }
+    while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        char* value = strchr(word, '=');
+        if (value == NULL) {
+            snprintf(error, size, "Expected key=value, got \"%s\"", word);
+            return 0;
+        }
+        *value++ = '\0';
+        if (strcmp(word, "scene") == 0) {
+            job->scene = value;
+        } else if (strcmp(word, "width") == 0) {
+            job->width = atoi(value);
+        } else if (strcmp(word, "height") == 0) {
+            job->height = atoi(value);
+        } else if (strcmp(word, "crop") == 0) {
+            int* c = job->crop;
+            if (sscanf(value, "%d,%d,%d,%d", &c[0], &c[1], &c[2], &c[3]) != 4 || c[0] < 0) {
+                snprintf(error, size, "Crop must be x0,y0,x1,y1");
+                return 0;
+            }
+        } else if (strcmp(word, "format") == 0) {
+            job->format = format_named(value);
+            if (job->format < 0) {
+                snprintf(error, size, "Unknown output format \"%s\"", value);
+                return 0;
+            }
+        } else if (strcmp(word, "aa") == 0) {
+            job->aa = atoi(value);
+            if (job->aa < 1 || job->aa > 16) {
+                snprintf(error, size, "aa must be between 1 and 16");
+                return 0;
+            }
+        } else {
+            snprintf(error, size, "Unknown job property \"%s\"", word);
+            return 0;
+        }
+    }
+    if (job->scene == NULL) {
+        snprintf(error, size, "Job has no scene");
+        return 0;
+    }
+    if (job->width <= 0 || job->height <= 0 || job->width > 65536 || job->height > 65536) {
+        snprintf(error, size, "Width and height must be between 1 and 65536");
+        return 0;
+    }
+    int* c = job->crop;
+    if (c[0] < 0) {
+        c[0] = 0;
+        c[1] = 0;
+        c[2] = job->width;
+        c[3] = job->height;
+    } else if (c[1] < 0 || c[0] >= c[2] || c[1] >= c[3] || c[2] > job->width || c[3] > job->height) {
+        snprintf(error, size, "Crop is not inside the image");
+        return 0;
+    }
+    return 1;
+}
+
+// talk to one client, queueing its jobs and streaming back each image
+void* server_client(void* arg) {
+    int fd = *(int*)arg;
+    free(arg);
+    FILE* in = fdopen(fd, "r");
+    char* line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, in) > 0) {
+        Job job;
+        char reply[320];
+        char header[128];
+        struct iovec iov[3];
+        char* text = NULL;
+        int count;
+        if (!parse_job(line, &job, job.error, sizeof(job.error))) {
+            iov[0].iov_base = reply;
+            iov[0].iov_len = snprintf(reply, sizeof(reply), "error %s\n", job.error);
+            count = 1;
+        } else {
+            job.next = NULL;
+            job.error[0] = '\0';
+            job.done = 0;
+            pthread_cond_init(&job.finished, NULL);
+            pthread_mutex_lock(&server.lock);
+            if (server.tail == NULL) {
+                server.head = &job;
+            } else {
+                server.tail->next = &job;
+            }
+            server.tail = &job;
+            pthread_cond_signal(&server.ready);
+            while (!job.done) {
+                pthread_cond_wait(&job.finished, &server.lock);
+            }
+            pthread_mutex_unlock(&server.lock);
+            pthread_cond_destroy(&job.finished);
+
+            if (job.error[0] != '\0') {
+                iov[0].iov_base = reply;
+                iov[0].iov_len = snprintf(reply, sizeof(reply), "error %s\n", job.error);
+                count = 1;
+            } else {
+                // the image goes out from here so the render thread can move on
+                image_iov(&job.render, job.format, header, iov + 1, &text);
+                iov[0].iov_base = reply;
+                iov[0].iov_len = snprintf(reply, sizeof(reply), "ok %zu\n", iov[1].iov_len + iov[2].iov_len);
+                count = 3;
+            }
+        }
+        int failed = write_all(fd, iov, count) != 0;
+        if (count == 3) {
+            free(text);
+            render_free(&job.render);
+        }
+        if (failed) {
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+    return NULL;
+}
+
+// server mode, render jobs from a unix socket until killed
+int serve_main(int argc, char** argv) {
+    char* path = NULL;
+    char* preload[64];
+    int preloads = 0;
+    server.threads = 1;
+    server.use_cache = 1;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            server.threads = atoi(argv[++a]);
+            if (server.threads <= 0) {
+                server.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (strcmp(argv[a], "--no-cache") == 0) {
+            server.use_cache = 0;
+        } else if (strncmp(argv[a], "--", 2) != 0 && path == NULL) {
+            path = argv[a];
+        } else if (strncmp(argv[a], "--", 2) != 0 && preloads < 64) {
+            preload[preloads++] = argv[a];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: raytracer serve [--threads N] [--no-cache] socket [input.json ...]\n");
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path \"%s\" is too long.\n", path);
+        exit(1);
+    }
+    strcpy(address.sun_path, path);
+
+    // loaded up front so the first previews don't pay for it
+    for (int i = 0; i < preloads; i++) {
+        char error[256];
+        if (resident_get(preload[i], error, sizeof(error)) == NULL) {
+            fprintf(stderr, "Error: %s\n", error);
+            exit(1);
+        }
+    }
+
+    // a socket left behind by an earlier server is replaced
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 64) != 0) {
+        fprintf(stderr, "Error: Could not listen on \"%s\"\n", path);
+        exit(1);
+    }
+    // a client hanging up mid image only ends its own connection
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, server_worker, NULL) != 0) {
+        fprintf(stderr, "Error: Could not start render thread.\n");
+        exit(1);
+    }
+    while (1) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error: Could not accept on \"%s\"\n", path);
+            exit(1);
+        }
+        int* arg = malloc(sizeof(int));
+        *arg = fd;
+        pthread_t client;
+        if (pthread_create(&client, NULL, server_client, arg) != 0) {
+            close(fd);
+            free(arg);
+            continue;
+        }
+        pthread_detach(client);
+    }
+}
+
+void usage(void) {
+    fprintf(stderr, "Usage: raytracer [options] width height input.json output.ppm\n");
+    fprintf(stderr, "  --threads N   render with N threads, 0 uses every core (default 1)\n");
+    fprintf(stderr, "  --format F    p6 (default), p3 or pfm; .pfm files default to pfm\n");
+    fprintf(stderr, "  --report-memory  print scene memory and peak process memory to stderr\n");
+    fprintf(stderr, "  --no-cache    always parse the json, even if input.json.rtc is current\n");
+    fprintf(stderr, "  --stats       print ray counters and phase timings as json on stdout\n");
+    fprintf(stderr, "  --aa N        supersample pixels on edges with N x N samples\n");
+    fprintf(stderr, "  --light-cutoff X  skip lights adding under X of full brightness (default 1/1024)\n");
+    fprintf(stderr, "  --light-samples K  shade each hit with K lights picked at random, 0 uses all\n");
+    fprintf(stderr, "  --region x0 y0 x1 y1  render only those pixels, as a part for merge\n");
+    fprintf(stderr, "  --processes N  render in N forked processes, one band each, and merge\n");
+    fprintf(stderr, "  --checkpoint  keep finished tiles in output.ckpt and resume from it\n");
+    fprintf(stderr, "  --stream      hold only a few rows in memory, written as they finish\n");
+    fprintf(stderr, "  --raster      bin spheres by screen cell and test primary rays against their cell\n");
+    fprintf(stderr, "  --gbuffer     keep first pass hits in output.gbuf and reshade from it after light edits\n");
+    fprintf(stderr, "  --time-budget MS  refine from a coarse image until MS milliseconds have passed\n");
+    fprintf(stderr, "       raytracer batch [options] width height input.json frames.json\n");
+    fprintf(stderr, "  render every frame of a frame list from one loaded scene\n");
+    fprintf(stderr, "       raytracer serve [--threads N] [--no-cache] socket [input.json ...]\n");
+    fprintf(stderr, "  keep scenes loaded and render jobs sent over a unix socket\n");
+    fprintf(stderr, "       raytracer compile input.json [output.rtc]\n");
+    fprintf(stderr, "  save a precompiled scene; renders of input.json load input.json.rtc\n");
+    fprintf(stderr, "  while it matches the json (input.json.f32.rtc in float builds)\n");
+    fprintf(stderr, "       raytracer mesh input.obj output.mesh\n");
+    fprintf(stderr, "  convert an obj file to a binary mesh for a scene's mesh objects\n");
+    fprintf(stderr, "       raytracer generate spheres planes lights output.json [seed]\n");
+    fprintf(stderr, "  write a procedural scene\n");
+    fprintf(stderr, "       raytracer bench [--threads N] [--size WxH] [--cases N] [--repeat N]\n");
+    fprintf(stderr, "  render generated scenes of increasing size and print json timings\n");
+    fprintf(stderr, "       raytracer merge [--format p6|p3] output.ppm part.ppm...\n");
+    fprintf(stderr, "  put parts written with --region together into one image\n");
+    fprintf(stderr, "       raytracer compare a.ppm b.ppm [tolerance [fraction]]\n");
+    fprintf(stderr, "  print the difference between two images, failing when more than\n");
+    fprintf(stderr, "  fraction of the channels (default 0) differ by more than tolerance\n");
+    exit(1);
+}
+
+// free a finished render and the scene, reporting memory use if asked
+int finish(Render* render, int report_memory) {
+    render_free(render);
+    if (report_memory) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "Scene memory: %zu bytes held, %zu bytes peak, %zu bytes mapped from cache\n",
+                scene_arena.reserved, arena_peak, scene_mapping_size);
+        fprintf(stderr, "Peak resident memory: %ld KB\n", usage.ru_maxrss);
+    }
+    arena_release(&scene_arena);
+    return 0;
+}
+
+// part files of a forked render, removed however the parent exits
+char** forked_parts = NULL;
+int forked_part_count = 0;
+
+void remove_forked_parts(void) {
+    for (int i = 0; i < forked_part_count; i++) {
+        unlink(forked_parts[i]);
+    }
+}
+
+// render the image as bands in forked worker processes, each writing its
+// part next to the output, then merge the parts. the workers share the
+// loaded scene with the parent, and their counters come back over a pipe
+void render_forked(Render* settings, int processes, int threads, char* output, int format) {
+    // every band needs at least one row
+    if (processes > settings->height) {
+        processes = settings->height;
+    }
+    int fds[2];
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "Error: Could not create a pipe.\n");
+        exit(1);
+    }
+    char** parts = malloc(sizeof(char*)*processes);
+    pid_t* pids = malloc(sizeof(pid_t)*processes);
+    // bands split the rows evenly, so no process is left with more than
+    // one row over its share
+    for (int i = 0; i < processes; i++) {
+        int y0 = (int)((long)settings->height * i / processes);
+        int y1 = (int)((long)settings->height * (i + 1) / processes);
+        size_t size = strlen(output) + 32;
+        parts[i] = malloc(size);
+        snprintf(parts[i], size, "%s.part%d", output, i);
+        fflush(NULL);
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            fprintf(stderr, "Error: Could not fork.\n");
+            exit(1);
+        }
+        if (pids[i] == 0) {
+            Render band;
+            close(fds[0]);
+            render_init_crop(&band, settings->width, settings->height, 0, y0, settings->width, y1, 0);
+            band.timing = settings->timing;
+            band.aa = settings->aa;
+            band.light_cutoff = settings->light_cutoff;
+            band.light_samples = settings->light_samples;
+            band.raster = settings->raster;
+            render_image(&band, threads);
+            write_image(&band, parts[i], FORMAT_PART);
+            if (write(fds[1], &band.stats, sizeof(Stats)) != sizeof(Stats)) {
+                _exit(1);
+            }
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+    // registered only now so the workers, which exit on their own errors,
+    // never remove each other's parts
+    forked_parts = parts;
+    forked_part_count = processes;
+    atexit(remove_forked_parts);
+    int failed = 0;
+    for (int i = 0; i < processes; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    // every worker's counters were written before it exited
+    Stats stats;
+    while (read(fds[0], &stats, sizeof(Stats)) == sizeof(Stats)) {
+        stats_merge(&settings->stats, &stats);
+    }
+    close(fds[0]);
+    if (failed) {
+        fprintf(stderr, "Error: A render process failed.\n");
+        exit(1);
+    }
+    merge_parts(output, format, parts, processes);
+    remove_forked_parts();
+    forked_part_count = 0;
+    for (int i = 0; i < processes; i++) {
+        free(parts[i]);
+    }
+    free(parts);
+    free(pids);
+}
+
+int main(int argc, char **argv) {
+    char* positional[4];
+    int count = 0;
+    int threads = 1;
+    char* format_name = NULL;
+    int report_memory = 0;
+    int use_cache = 1;
+    int stats = 0;
+    int aa = 0;
+    int batch = 0;
+    double light_cutoff = LIGHT_CUTOFF;
+    int light_samples = 0;
+    int region[4] = {-1, -1, -1, -1};
+    int processes = 1;
+    int checkpoint = 0;
+    int stream = 0;
+    int raster = 0;
+    int gbuffer = 0;
+    double budget = 0;
+
+    if (argc > 1 && strcmp(argv[1], "compile") == 0) {
+        return compile_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "mesh") == 0) {
+        return mesh_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "generate") == 0) {
+        return generate_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return bench_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return serve_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "compare") == 0) {
+        return compare_main(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        return merge_main(argc, argv);
+    }
+    // batch takes the same options, with a frame list in place of the output
+    if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+        batch = 1;
+    }
+
+    for (int a = 1 + batch; a < argc; a++) {
+        if (strcmp(argv[a], "--threads") == 0) {
+            if (a + 1 >= argc) usage();
+            threads = atoi(argv[++a]);
+            if (threads <= 0) {
+                threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (strcmp(argv[a], "--format") == 0) {
+            if (a + 1 >= argc) usage();
+            format_name = argv[++a];
+        } else if (strcmp(argv[a], "--report-memory") == 0) {
+            report_memory = 1;
+        } else if (strcmp(argv[a], "--no-cache") == 0) {
+            use_cache = 0;
+        } else if (strcmp(argv[a], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[a], "--aa") == 0) {
+            if (a + 1 >= argc) usage();
+            aa = atoi(argv[++a]);
+            if (aa < 1 || aa > 16) {
+                fprintf(stderr, "Error: --aa must be between 1 and 16.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--light-cutoff") == 0) {
+            if (a + 1 >= argc) usage();
+            light_cutoff = atof(argv[++a]);
+            if (light_cutoff < 0 || light_cutoff >= 1) {
+                fprintf(stderr, "Error: --light-cutoff must be at least 0 and below 1.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--light-samples") == 0) {
+            if (a + 1 >= argc) usage();
+            light_samples = atoi(argv[++a]);
+            if (light_samples < 0) {
+                fprintf(stderr, "Error: --light-samples can't be negative.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--region") == 0) {
+            if (a + 4 >= argc) usage();
+            for (int k = 0; k < 4; k++) {
+                region[k] = atoi(argv[++a]);
+            }
+        } else if (strcmp(argv[a], "--checkpoint") == 0) {
+            checkpoint = 1;
+        } else if (strcmp(argv[a], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[a], "--raster") == 0) {
+            raster = 1;
+        } else if (strcmp(argv[a], "--gbuffer") == 0) {
+            gbuffer = 1;
+        } else if (strcmp(argv[a], "--time-budget") == 0) {
+            if (a + 1 >= argc) usage();
+            budget = atof(argv[++a]);
+            if (!(budget > 0)) {
+                fprintf(stderr, "Error: --time-budget must be a positive number of milliseconds.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--processes") == 0) {
+            if (a + 1 >= argc) usage();
+            processes = atoi(argv[++a]);
+            if (processes <= 0) {
+                processes = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (strncmp(argv[a], "--", 2) == 0) {
+            fprintf(stderr, "Error: Unknown option \"%s\".\n", argv[a]);
+            usage();
+        } else if (count < 4) {
+            positional[count++] = argv[a];
+        } else {
+            usage();
+        }
+    }
+    if (count != 4) usage();
+    if (aa == 0) {
+        aa = budget > 0 ? PROGRESSIVE_AA : 1;
+    }
+    // the budget counts from here, loading the scene included
+    double deadline = budget > 0 ? now_seconds() + budget / 1000 : 0;
+
+    load_scene(positional[2], use_cache);
+    
+    int M = atoi(positional[1]);
+    int N = atoi(positional[0]);
+    if (M <= 0 || N <= 0) {
+        fprintf(stderr, "Error: Width and height must be positive.\n");
+        exit(1);
+    }
+    int cropped = region[0] >= 0;
+    if (cropped && (region[0] >= region[2] || region[1] >= region[3] ||
+                    region[2] > N || region[3] > M)) {
+        fprintf(stderr, "Error: --region must lie inside the image and hold at least one pixel.\n");
+        exit(1);
+    }
+    if ((cropped || processes > 1) && batch) {
+        fprintf(stderr, "Error: --region and --processes render single images.\n");
+        exit(1);
+    }
+    if (checkpoint && (cropped || processes > 1 || batch)) {
+        fprintf(stderr, "Error: --checkpoint only works for a whole image in one process.\n");
+        exit(1);
+    }
+    if (stream && (cropped || processes > 1 || batch || checkpoint)) {
+        fprintf(stderr, "Error: --stream only works for a whole image in one process, without --checkpoint.\n");
+        exit(1);
+    }
+    if (budget > 0 && (cropped || processes > 1 || batch || checkpoint || stream || gbuffer)) {
+        fprintf(stderr, "Error: --time-budget only works for a whole image in one process, "
+                "without --checkpoint, --stream or --gbuffer.\n");
+        exit(1);
+    }
+    if (gbuffer && (cropped || processes > 1 || batch || checkpoint || stream)) {
+        fprintf(stderr, "Error: --gbuffer only works for a whole image in one process, "
+                "without --checkpoint or --stream.\n");
+        exit(1);
+    }
+    Render render;
+    if (batch) {
+        render_init(&render, N, M, 0);
+        render.timing = stats;
+        render.aa = aa;
+        render.light_cutoff = light_cutoff;
+        render.light_samples = light_samples;
+        render.raster = raster;
+        render_frames(&render, positional[3], threads, format_name, stats);
+        return finish(&render, report_memory);
+    }
+    int format = image_format(format_name, positional[3]);
+    if (cropped || processes > 1) {
+        if (format == FORMAT_PFM) {
+            fprintf(stderr, "Error: --region and --processes write 8 bit images, not pfm.\n");
+            exit(1);
+        }
+        if (cropped && format_name != NULL) {
+            fprintf(stderr, "Error: --region always writes a part for merge.\n");
+            exit(1);
+        }
+    }
+
+    if (cropped) {
+        render_init_crop(&render, N, M, region[0], region[1], region[2], region[3], 0);
+        format = FORMAT_PART;
+    } else if (processes > 1 || stream) {
+        // only the settings and the summed counters, the pixels are elsewhere
+        render_init_crop(&render, N, M, 0, 0, 0, 0, 0);
+    } else {
+        render_init(&render, N, M, format == FORMAT_PFM);
+    }
+    render.timing = stats;
+    render.aa = aa;
+    render.light_cutoff = light_cutoff;
+    render.light_samples = light_samples;
+    render.raster = raster;
+    render.deadline = deadline;
+    char checkpoint_path[4096];
+    if (checkpoint) {
+        snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.ckpt", positional[3]);
+        checkpoint_open(&render, checkpoint_path, positional[2]);
+    }
+    char gbuffer_path[4096];
+    if (gbuffer) {
+        snprintf(gbuffer_path, sizeof(gbuffer_path), "%s.gbuf", positional[3]);
+        gbuffer_open(&render, gbuffer_path);
+    }
+
+    double start = now_seconds();
+    if (processes > 1 && !cropped) {
+        render_forked(&render, processes, threads, positional[3], format);
+        phase_seconds[PHASE_RENDER] += now_seconds() - start;
+    } else if (stream) {
+        // writes overlap the render, so they are counted in its time
+        render_stream(&render, threads, positional[3], format);
+        phase_seconds[PHASE_RENDER] += now_seconds() - start;
+    } else {
+        render_image(&render, threads);
+        double rendered = now_seconds();
+        write_image(&render, positional[3], format);
+        phase_seconds[PHASE_RENDER] += rendered - start;
+        phase_seconds[PHASE_WRITE] += now_seconds() - rendered;
+    }
+    if (checkpoint) {
+        checkpoint_close(&render, checkpoint_path);
+    }
+    if (gbuffer) {
+        gbuffer_close(&render, gbuffer_path);
+    }
+    if (deadline > 0) {
+        report_levels(&render);
+    }
+    if (stats) {
+        print_stats(stdout, &render, threads);
+    }
+    return finish(&render, report_memory);
+}
+